@@ -0,0 +1,1349 @@
+#ifndef ASYNC_LOGGER_H_
+#define ASYNC_LOGGER_H_
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "crash.h"
+#include "cycle_clock.h"
+#include "logger.h"
+
+// AsyncFileLogger::FlushAsync() needs C++20 coroutines; configure with
+// -DLOGGER_CXX20=ON for them.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define LOGGER_HAS_COROUTINES 1
+#endif
+
+// What a producer does when the queue of an AsyncFileLogger is full.
+enum class OverflowPolicy {
+  kBlock,       // Wait until the writer thread makes room.
+  kDropNewest,  // Discard the record being logged.
+  kDropOldest,  // Discard the oldest queued record to make room.
+};
+
+// How an AsyncFileLogger adapts to a slow file; off unless min_batch_size
+// is set.
+//
+// The writer thread times every write. Batches start at min_batch_size
+// records, so that records reach the file soon after they are logged while
+// it keeps up. A write slower than `slow_write` doubles the batch, up to
+// max_batch_size, and a faster one halves it again, so a stalling device
+// gets fewer, larger writes.
+//
+// If a write takes longer than `shed_write`, or the queue is more than
+// three quarters full, the logger sheds load: the producers discard
+// records below `keep_level` before they are queued, except one in
+// `sample_every` (0 keeps none), so they neither block nor allocate for
+// them. Shedding stops once a write is fast again and the queue is less
+// than a quarter full. Every second at most, a WARNING record tells how
+// many records were shed since the last one.
+struct AdaptivePolicy {
+  size_t min_batch_size = 0;
+  std::chrono::microseconds slow_write{1000};
+  std::chrono::microseconds shed_write{50000};
+  Level keep_level = Level::kWarning;
+  uint32_t sample_every = 100;
+
+  bool enabled() const { return min_batch_size > 0; }
+};
+
+// Bounded lock-free queue based on Dmitry Vyukov's MPMC ring. Every cell
+// carries a sequence number telling producers and consumers whose turn it
+// is, so a push or pop is a single CAS on the shared position. AsyncFileLogger
+// drains it from one writer thread; producers only pop to evict the oldest
+// record under OverflowPolicy::kDropOldest.
+template <typename T>
+class BoundedQueue {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Returns false if the queue is full, in which case value is untouched.
+  bool TryPush(T& value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool TryPop(T& value) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // May report a slot as used while its producer is still filling it in.
+  bool Empty() const {
+    return enqueue_pos_.load(std::memory_order_seq_cst) ==
+           dequeue_pos_.load(std::memory_order_seq_cst);
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  // Calls fn(value) on the queued values, oldest first, without popping
+  // them. Takes no lock, so a crash handler can call it, but races with
+  // the consumer, which may be moving a value out meanwhile.
+  template <typename Fn>
+  void Peek(Fn fn) const {
+    size_t pos = dequeue_pos_.load(std::memory_order_acquire);
+    size_t end = enqueue_pos_.load(std::memory_order_acquire);
+    if (end - pos > Capacity()) {
+      return;
+    }
+    for (; pos != end; ++pos) {
+      const Cell& cell = cells_[pos & mask_];
+      if (cell.sequence.load(std::memory_order_acquire) == pos + 1) {
+        fn(cell.value);
+      }
+    }
+  }
+
+  // The number of records queued, give or take those being pushed or
+  // popped.
+  size_t Size() const {
+    size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  // Keep the two positions on separate cache lines.
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_;
+  char pad1_[64];
+  std::atomic<size_t> dequeue_pos_;
+  char pad2_[64];
+  size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+};
+
+// Bounded single-producer single-consumer ring. Each side only writes its
+// own position and caches the other one, so a push or pop touches the
+// shared cache lines only when the cached position runs out.
+template <typename T>
+class SpscQueue {
+ public:
+  // The capacity is rounded up to a power of two.
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_.reset(new T[size]);
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer only. Returns false if the queue is full, in which case value
+  // is untouched.
+  bool TryPush(T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    cells_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool TryPop(T& value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+    value = std::move(cells_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+  // Like BoundedQueue::Peek.
+  template <typename Fn>
+  void Peek(Fn fn) const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    if (tail - head > Capacity()) {
+      return;
+    }
+    for (; head != tail; ++head) {
+      fn(cells_[head & mask_]);
+    }
+  }
+
+ private:
+  // The producer's and the consumer's halves on separate cache lines.
+  char pad0_[64];
+  std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+  char pad1_[64];
+  std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  char pad2_[64];
+  size_t mask_;
+  std::unique_ptr<T[]> cells_;
+};
+
+// The flush policy is applied per batch: a batch counts as many records as
+// it holds.
+struct AsyncFileLoggerOptions : FileLoggerOptions {
+  // Maximum number of records waiting for the writer thread.
+  size_t queue_capacity = 8192;
+  OverflowPolicy overflow_policy = OverflowPolicy::kBlock;
+  // Maximum number of records the writer thread writes with one call.
+  size_t max_batch_size = 512;
+  // The writer thread also stops collecting a batch at this many bytes...
+  size_t max_batch_bytes = 1 << 20;
+  // ...or once it has been collecting for this long, so the first records
+  // of a batch are not held back by the ones behind them; 0 disables.
+  std::chrono::microseconds max_batch_latency{0};
+  // Hand a batch to the file as slices, written with one writev(2) when it
+  // goes to a file::File, so messages of at least kMinGatheredMessage bytes
+  // are written from the record instead of being copied into the batch.
+  bool vectored_writes = false;
+  // Give every producer thread a SpscQueue of its own, of queue_capacity
+  // records, instead of sharing one queue, so producers on different cores
+  // never write to the same cache line. The writer thread merges the
+  // queues by timestamp. Producers cannot evict records from their queue,
+  // so OverflowPolicy::kDropOldest drops the newest record instead.
+  bool sharded = false;
+  AdaptivePolicy adaptive;
+};
+
+// Writes the same "[time] message" lines as FileLogger, but Print only
+// enqueues the record. A background thread formats the records and writes
+// them to the file in batches. With the default policy it flushes once per
+// batch.
+//
+// In sharded mode every batch is sorted by time across the per-thread
+// queues, so lines are in order unless a thread is preempted, or blocked on
+// a full queue, between taking the time and queueing its record for longer
+// than a batch takes.
+//
+// On a crash (see crash.h) the queued records are written after what the
+// file holds.
+//
+// An event loop, which must not block, logs with TryPrint() and flushes
+// with RequestFlush(), or co_await FlushAsync(), and watches
+// CompletionFd() to call RunCompletions() from the loop when a flush is
+// done:
+//
+//   epoll_event event = {EPOLLIN, {.ptr = &logger}};
+//   epoll_ctl(epoll, EPOLL_CTL_ADD, logger.CompletionFd(), &event);
+//   ...
+//   if (!logger.TryPrint(Level::kInfo, "{} accepted", peer)) ++unlogged;
+//   co_await logger.FlushAsync();  // Resumed by RunCompletions().
+//   ...
+//   // When epoll_wait() returns the event:
+//   logger.RunCompletions();
+class AsyncFileLogger : public Logger, private internal::CrashDrainable {
+ public:
+  // With vectored_writes, shorter messages are still copied: for them a
+  // slice costs more than the copy.
+  static constexpr size_t kMinGatheredMessage = 256;
+  // Queues in sharded mode beyond this many are not drained on a crash.
+  enum : size_t { kMaxCrashShards = 256 };
+
+  AsyncFileLogger(
+      const std::string& path, const std::string& name,
+      const AsyncFileLoggerOptions& options = AsyncFileLoggerOptions())
+      : file_(path + "/log-" + name + ".txt", options, &stats()),
+        options_(options),
+        queue_(options.sharded ? 1 : options.queue_capacity),
+        serial_(NextSerial()),
+        utc_offset_(internal::LocalUtcOffset()),
+        batch_limit_(options.adaptive.enabled()
+                         ? std::min(options.adaptive.min_batch_size,
+                                    options.max_batch_size)
+                         : options.max_batch_size),
+        writer_(&AsyncFileLogger::WriterLoop, this) {
+    for (std::atomic<Shard*>& shard : crash_shards_) {
+      shard.store(nullptr, std::memory_order_relaxed);
+    }
+    internal::CrashRegistry::Register(this);
+    Print("{} started", name);
+  }
+
+  using Logger::Print;
+  void Print(const std::string& str) override {
+    if (Shed(Level::kInfo)) {
+      return;
+    }
+    Record record{internal::CycleClock::Now(), Level::kInfo, str, 0};
+    Push(record, options_.overflow_policy);
+  }
+
+  // The record owns a copy of the message until the writer thread is done
+  // with it, so this is the one allocation left on the producer side.
+  void PrintMessage(Level level, StringView message) override {
+    if (Shed(level)) {
+      return;
+    }
+    Record record{internal::CycleClock::Now(), level, message.ToString(),
+                  0};
+    Push(record, options_.overflow_policy);
+  }
+
+  // Blocks until every record printed before the call has been written and
+  // flushed by the writer thread.
+  void Flush() override {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = ++flush_requested_;
+      if (options_.sharded) {
+        // The writer drains every queue before it completes the request.
+        writer_cv_.notify_one();
+      }
+    }
+    if (options_.sharded) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (flush_completed_ < id) {
+        flushed_cv_.wait(lock);
+      }
+      return;
+    }
+    Record marker{0, Level::kInfo, std::string(), id};
+    Push(marker, OverflowPolicy::kBlock);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (flush_completed_ < id) {
+      flushed_cv_.wait(lock);
+    }
+  }
+
+  // Print(level, format, args...) that never blocks, whatever the overflow
+  // policy: returns whether the record was queued. One the queue has no
+  // room for is neither printed nor counted as dropped, and a shed one (see
+  // AdaptivePolicy) is not printed either; the caller decides whether to
+  // try again. A disabled level has nothing to print and returns true.
+  template <typename... Args>
+  bool TryPrint(Level level, StringView format, Args&&... args) {
+    if (!IsEnabled(level)) {
+      return true;
+    }
+    if (Shed(level)) {
+      return false;
+    }
+    internal::ScopedLineBuffer buffer;
+    internal::StrFormat(buffer.get(), format, args...);
+    Record record{internal::CycleClock::Now(), level,
+                  buffer->view().ToString(), 0};
+    bool queued = options_.sharded ? LocalShard().queue.TryPush(record)
+                                   : queue_.TryPush(record);
+    if (queued) {
+      Queued(record);
+    }
+    return queued;
+  }
+
+  // Flush() without waiting, even when the queue is full: returns an id
+  // for Flushed() and OnFlushed().
+  uint64_t RequestFlush() {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = ++flush_requested_;
+      if (options_.sharded) {
+        writer_cv_.notify_one();
+        return id;
+      }
+    }
+    Record marker{0, Level::kInfo, std::string(), id};
+    if (queue_.TryPush(marker)) {
+      Queued(marker);
+    } else {
+      // The writer thread queues it once it has made room.
+      std::lock_guard<std::mutex> lock(mutex_);
+      deferred_flush_id_ = id;
+      writer_cv_.notify_one();
+    }
+    return id;
+  }
+
+  // Are the records logged before RequestFlush() returned `id` durable?
+  bool Flushed(uint64_t id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return flush_completed_ >= id;
+  }
+
+  // Has RunCompletions() call `done` once the flush `id` is complete.
+  void OnFlushed(uint64_t id, std::function<void()> done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OpenCompletionFd();
+    completions_.push_back(Completion{id, std::move(done)});
+    if (flush_completed_ >= id) {
+      SignalCompletion();
+    }
+  }
+
+  // A descriptor that becomes readable when a flush completes, for an
+  // event loop to watch and call RunCompletions(): an eventfd on Linux, a
+  // pipe on other POSIX systems, -1 on Windows or if none can be created.
+  // Then the loop has to call RunCompletions() from time to time instead.
+  int CompletionFd() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OpenCompletionFd();
+    return completion_fds_[0];
+  }
+
+  // Clears CompletionFd() and calls, on this thread, the OnFlushed()
+  // callbacks of the flushes that are complete. Returns how many it called.
+  size_t RunCompletions() {
+#ifndef _WIN32
+    int fd;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      fd = completion_fds_[0];
+    }
+    // Before looking at the flushes, so that one completing meanwhile
+    // leaves the descriptor readable.
+    char buffer[64];
+    while (fd >= 0 && ::read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+#endif
+    std::vector<Completion> done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto complete = std::stable_partition(
+          completions_.begin(), completions_.end(),
+          [this](const Completion& completion) {
+            return completion.id > flush_completed_;
+          });
+      std::move(complete, completions_.end(), std::back_inserter(done));
+      completions_.erase(complete, completions_.end());
+    }
+    for (Completion& completion : done) {
+      completion.done();
+    }
+    return done.size();
+  }
+
+#ifdef LOGGER_HAS_COROUTINES
+  // What FlushAsync() returns.
+  class FlushAwaiter {
+   public:
+    FlushAwaiter(AsyncFileLogger* logger, uint64_t id)
+        : logger_(logger), id_(id) {}
+
+    bool await_ready() const { return logger_->Flushed(id_); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      logger_->OnFlushed(id_, [handle]() { handle.resume(); });
+    }
+    void await_resume() const {}
+
+   private:
+    AsyncFileLogger* logger_;
+    uint64_t id_;
+  };
+
+  // co_await logger.FlushAsync() suspends the coroutine until the records
+  // logged before are durable, unless they already are, and resumes it
+  // from RunCompletions(). The logger must outlive the coroutines waiting.
+  FlushAwaiter FlushAsync() { return FlushAwaiter(this, RequestFlush()); }
+#endif
+
+  // Writes every queued record, then "Closing the log.", before closing
+  // the file.
+  ~AsyncFileLogger() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    writer_cv_.notify_one();
+    writer_.join();
+    internal::CrashRegistry::Unregister(this);
+#ifndef _WIN32
+    for (int i = 0; i < 2; ++i) {
+      if (completion_fds_[i] >= 0 &&
+          (i == 0 || completion_fds_[1] != completion_fds_[0])) {
+        ::close(completion_fds_[i]);
+      }
+    }
+#endif
+  }
+
+  // Number of records discarded because the queue was full.
+  uint64_t Dropped() const { return Stats().dropped; }
+
+ private:
+  // Producers only read the cycle counter; the writer thread turns the
+  // ticks into wall-clock time.
+  struct Record {
+    int64_t ticks;
+    Level level;
+    std::string message;
+    // Non-zero for the markers pushed by Flush().
+    uint64_t flush_id;
+  };
+
+  // One producer thread's queue in sharded mode. A thread releases its
+  // shard when it exits, and the next new thread takes it over.
+  struct Shard {
+    explicit Shard(size_t capacity) : queue(capacity) {}
+    SpscQueue<Record> queue;
+    std::atomic<bool> owned{true};
+  };
+
+  // The shards of the sharded loggers a thread has logged to, by logger
+  // serial. Evicting an entry releases the shard as well.
+  struct ShardCache {
+    struct Entry {
+      uint64_t serial = 0;
+      std::shared_ptr<Shard> shard;
+    };
+    static constexpr size_t kSize = 8;
+    Entry entries[kSize];
+
+    ~ShardCache() {
+      for (Entry& entry : entries) {
+        if (entry.shard) {
+          entry.shard->owned.store(false, std::memory_order_release);
+        }
+      }
+    }
+  };
+
+  // The writer thread's view of a shard: the next record, already popped.
+  struct ShardHead {
+    Record record;
+    bool valid = false;
+  };
+
+  static uint64_t NextSerial() {
+    static std::atomic<uint64_t> serial(0);
+    return ++serial;
+  }
+
+  // Whether to discard a record while shedding load, counting it if so.
+  bool Shed(Level level) {
+    const AdaptivePolicy& policy = options_.adaptive;
+    if (!shedding_.load(std::memory_order_relaxed) ||
+        level >= policy.keep_level) {
+      return false;
+    }
+    static thread_local uint32_t sampled = 0;
+    if (policy.sample_every > 0 && ++sampled % policy.sample_every == 0) {
+      return false;
+    }
+    stats().AddShed(1);
+    return true;
+  }
+
+  void Push(Record& record, OverflowPolicy policy) {
+    if (options_.sharded) {
+      Shard& shard = LocalShard();
+      if (!shard.queue.TryPush(record)) {
+        if (policy != OverflowPolicy::kBlock) {
+          stats().AddDropped(1);
+          return;
+        }
+        PushBlocking(shard.queue, record);
+      }
+    } else if (!queue_.TryPush(record)) {
+      switch (policy) {
+        case OverflowPolicy::kBlock:
+          PushBlocking(queue_, record);
+          break;
+        case OverflowPolicy::kDropNewest:
+          stats().AddDropped(1);
+          return;
+        case OverflowPolicy::kDropOldest: {
+          Record oldest;
+          do {
+            if (queue_.TryPop(oldest)) {
+              if (oldest.flush_id != 0) {
+                // Everything before the marker is already with the writer.
+                std::lock_guard<std::mutex> lock(mutex_);
+                evicted_flush_id_ = oldest.flush_id;
+              } else {
+                stats().AddDropped(1);
+              }
+            }
+          } while (!queue_.TryPush(record));
+          break;
+        }
+      }
+    }
+    Queued(record);
+  }
+
+  // Wakes the writer thread for a record just queued. Moving the message
+  // into the queue left the rest of `record` as it was.
+  void Queued(const Record& record) {
+    if (writer_sleeping_.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writer_cv_.notify_one();
+    }
+    if (record.flush_id == 0) {
+      stats().AddProducerLatency(internal::CycleClock::Now() - record.ticks);
+    }
+  }
+
+  // Called with mutex_ held.
+  void OpenCompletionFd() {
+#ifndef _WIN32
+    if (completion_fds_[0] >= 0 || completion_failed_) {
+      return;
+    }
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    completion_fds_[0] = fd;
+    completion_fds_[1] = fd;
+#else
+    if (pipe(completion_fds_) == 0) {
+      for (int fd : completion_fds_) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    } else {
+      completion_fds_[0] = completion_fds_[1] = -1;
+    }
+#endif
+    completion_failed_ = completion_fds_[0] < 0;
+#endif
+  }
+
+  // Makes CompletionFd() readable. Called with mutex_ held.
+  void SignalCompletion() {
+#ifndef _WIN32
+    if (completion_fds_[1] >= 0) {
+      // Eight bytes, as an eventfd takes. A full pipe is readable already.
+      uint64_t one = 1;
+      if (::write(completion_fds_[1], &one, sizeof(one)) < 0) {
+      }
+    }
+#endif
+  }
+
+  template <typename Queue>
+  void PushBlocking(Queue& queue, Record& record) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++blocked_producers_;
+    writer_cv_.notify_one();
+    while (!queue.TryPush(record)) {
+      space_cv_.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    --blocked_producers_;
+  }
+
+  Shard& LocalShard() {
+    static thread_local ShardCache cache;
+    ShardCache::Entry& entry = cache.entries[serial_ % ShardCache::kSize];
+    if (entry.serial != serial_) {
+      if (entry.shard) {
+        entry.shard->owned.store(false, std::memory_order_release);
+      }
+      entry.shard = AcquireShard();
+      entry.serial = serial_;
+    }
+    return *entry.shard;
+  }
+
+  std::shared_ptr<Shard> AcquireShard() {
+    std::lock_guard<std::mutex> lock(shards_mutex_);
+    for (const std::shared_ptr<Shard>& shard : shards_) {
+      bool owned = false;
+      if (shard->owned.compare_exchange_strong(owned, true,
+                                               std::memory_order_acquire)) {
+        return shard;
+      }
+    }
+    shards_.emplace_back(new Shard(options_.queue_capacity));
+    if (shards_.size() <= kMaxCrashShards) {
+      crash_shards_[shards_.size() - 1].store(shards_.back().get(),
+                                              std::memory_order_release);
+    }
+    shard_count_.store(shards_.size(), std::memory_order_release);
+    return shards_.back();
+  }
+
+  // Adds a record to the batch; with vectored_writes a long message is moved
+  // out of `record`.
+  void AddToBatch(Record& record) {
+    batch_ticks_.push_back(record.ticks);
+    internal::AppendLinePrefix(
+        batch_, internal::CycleClock::ToTime(record.ticks), record.level,
+        options_.timestamp_precision, options_.print_level);
+    if (options_.vectored_writes &&
+        record.message.size() >= kMinGatheredMessage) {
+      gathered_bytes_ += record.message.size();
+      cuts_.push_back(batch_.size());
+      gathered_.push_back(std::move(record.message));
+    } else {
+      batch_ += record.message;
+    }
+    batch_ += '\n';
+  }
+
+  // Stops a batch at max_batch_size records, or fewer as AdaptivePolicy
+  // decides, max_batch_bytes bytes or max_batch_latency since `start`.
+  bool BatchFull(size_t count,
+                 std::chrono::steady_clock::time_point start) const {
+    if (count >= batch_limit_ ||
+        batch_.size() + gathered_bytes_ >= options_.max_batch_bytes) {
+      return true;
+    }
+    // Look at the clock every few records only.
+    return options_.max_batch_latency.count() > 0 && count % 16 == 0 &&
+           count > 0 &&
+           std::chrono::steady_clock::now() - start >=
+               options_.max_batch_latency;
+  }
+
+  // Returns how long the file took.
+  std::chrono::steady_clock::duration WriteBatch(size_t count,
+                                                 Level max_level) {
+    auto write_start = std::chrono::steady_clock::now();
+    if (gathered_.empty()) {
+      file_.Write(batch_.view(), count, max_level);
+    } else {
+      // The buffered text runs between the gathered messages.
+      size_t start = 0;
+      for (size_t i = 0; i < gathered_.size(); ++i) {
+        slices_.push_back({batch_.data() + start, cuts_[i] - start});
+        slices_.push_back({gathered_[i].data(), gathered_[i].size()});
+        start = cuts_[i];
+      }
+      slices_.push_back({batch_.data() + start, batch_.size() - start});
+      file_.WriteV(slices_.data(), slices_.size(), count, max_level);
+      slices_.clear();
+      gathered_.clear();
+      cuts_.clear();
+      gathered_bytes_ = 0;
+    }
+    auto took = std::chrono::steady_clock::now() - write_start;
+    batch_.clear();
+    batch_.ShrinkToLimit();
+
+    int64_t now = internal::CycleClock::Now();
+    for (int64_t ticks : batch_ticks_) {
+      stats().AddWriterLatency(now - ticks);
+    }
+    batch_ticks_.clear();
+    stats().AddRecords(count);
+    return took;
+  }
+
+  // Writer thread only: applies the AdaptivePolicy after a write that took
+  // `took`, or with zero when there was nothing to write.
+  void Adapt(std::chrono::steady_clock::duration took) {
+    const AdaptivePolicy& policy = options_.adaptive;
+    if (took > policy.slow_write) {
+      batch_limit_ = std::min(batch_limit_ * 2, options_.max_batch_size);
+    } else {
+      batch_limit_ = std::max(batch_limit_ / 2,
+                              std::min(policy.min_batch_size,
+                                       options_.max_batch_size));
+    }
+    size_t capacity =
+        options_.queue_capacity *
+        (options_.sharded ? std::max<size_t>(writer_shards_.size(), 1) : 1);
+    size_t depth = QueueDepth();
+    auto now = std::chrono::steady_clock::now();
+    if (!shedding_.load(std::memory_order_relaxed)) {
+      if (took > policy.shed_write || depth * 4 > capacity * 3) {
+        shedding_.store(true, std::memory_order_relaxed);
+        if (stats().Shed() == shed_reported_) {
+          last_report_ = now;
+        }
+      }
+    } else if (took <= policy.slow_write && depth * 4 < capacity) {
+      shedding_.store(false, std::memory_order_relaxed);
+    }
+    // At most once a second, so that a file that keeps stalling does not
+    // fill the log with reports. Once stopping, the last report is left
+    // for the writer to make just before "Closing the log.".
+    if (!stopping_ && now - last_report_ >= std::chrono::seconds(1)) {
+      ReportShed(now);
+    }
+  }
+
+  // Writes how many records were shed since the last report, if any.
+  void ReportShed(std::chrono::steady_clock::time_point now) {
+    uint64_t shed = stats().Shed();
+    if (shed == shed_reported_) {
+      return;
+    }
+    internal::ScopedLineBuffer message;
+    internal::StrFormat(
+        message.get(), "shed {} records below {} in {} ms: the log is slow",
+        shed - shed_reported_, LevelName(options_.adaptive.keep_level),
+        std::chrono::duration_cast<std::chrono::milliseconds>(now -
+                                                              last_report_)
+            .count());
+    Record record{internal::CycleClock::Now(), Level::kWarning,
+                  message->view().ToString(), 0};
+    AddToBatch(record);
+    WriteBatch(1, Level::kWarning);
+    shed_reported_ = shed;
+    last_report_ = now;
+  }
+
+  // Writer thread only.
+  size_t QueueDepth() const {
+    if (!options_.sharded) {
+      return queue_.Size();
+    }
+    size_t depth = 0;
+    for (const std::shared_ptr<Shard>& shard : writer_shards_) {
+      depth += shard->queue.Size();
+    }
+    return depth;
+  }
+
+  // Adds records from the shards to the batch, oldest first, using a heap
+  // of the shards ordered by the time of their next record. Every shard is
+  // empty afterwards unless the batch is full, in which case heap_ is not.
+  size_t MergeShards(Level& max_level,
+                     std::chrono::steady_clock::time_point start) {
+    if (shard_count_.load(std::memory_order_acquire) != writer_shards_.size()) {
+      std::lock_guard<std::mutex> lock(shards_mutex_);
+      writer_shards_ = shards_;
+      heads_.resize(writer_shards_.size());
+    }
+    auto later = [this](size_t a, size_t b) {
+      return heads_[a].record.ticks > heads_[b].record.ticks;
+    };
+    heap_.clear();
+    for (size_t i = 0; i < writer_shards_.size(); ++i) {
+      if (!heads_[i].valid) {
+        heads_[i].valid = writer_shards_[i]->queue.TryPop(heads_[i].record);
+      }
+      if (heads_[i].valid) {
+        heap_.push_back(i);
+      }
+    }
+    std::make_heap(heap_.begin(), heap_.end(), later);
+    size_t count = 0;
+    while (!BatchFull(count, start) && !heap_.empty()) {
+      std::pop_heap(heap_.begin(), heap_.end(), later);
+      size_t i = heap_.back();
+      heap_.pop_back();
+      if (heads_[i].record.level > max_level) {
+        max_level = heads_[i].record.level;
+      }
+      AddToBatch(heads_[i].record);
+      ++count;
+      heads_[i].valid = !internal::CrashRegistry::Draining() &&
+                        writer_shards_[i]->queue.TryPop(heads_[i].record);
+      if (heads_[i].valid) {
+        heap_.push_back(i);
+        std::push_heap(heap_.begin(), heap_.end(), later);
+      }
+    }
+    return count;
+  }
+
+  // Writer thread only. May miss a record whose producer is still pushing.
+  bool Empty() const {
+    if (!options_.sharded) {
+      return queue_.Empty();
+    }
+    for (size_t i = 0; i < writer_shards_.size(); ++i) {
+      if (heads_[i].valid || !writer_shards_[i]->queue.Empty()) {
+        return false;
+      }
+    }
+    return shard_count_.load(std::memory_order_acquire) ==
+           writer_shards_.size();
+  }
+
+  void WriterLoop() {
+    Record record;
+    while (true) {
+      if (internal::CrashRegistry::Draining()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      size_t count = 0;
+      Level max_level = Level::kTrace;
+      uint64_t flush_id = 0;
+      std::chrono::steady_clock::time_point start;
+      if (options_.max_batch_latency.count() > 0) {
+        start = std::chrono::steady_clock::now();
+      }
+      stats().UpdateQueueDepth(QueueDepth());
+      if (options_.sharded) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          flush_id = flush_requested_;
+        }
+        count = MergeShards(max_level, start);
+        if (!heap_.empty()) {
+          flush_id = 0;  // Not drained yet; check again after this batch.
+        }
+      }
+      while (!options_.sharded && !BatchFull(count, start) &&
+             !internal::CrashRegistry::Draining() && queue_.TryPop(record)) {
+        if (record.flush_id != 0) {
+          flush_id = record.flush_id;
+          break;
+        }
+        if (record.level > max_level) {
+          max_level = record.level;
+        }
+        AddToBatch(record);
+        ++count;
+      }
+      if (count > 0) {
+        std::chrono::steady_clock::duration took =
+            WriteBatch(count, max_level);
+        if (options_.adaptive.enabled()) {
+          Adapt(took);
+        }
+      } else if (options_.adaptive.enabled()) {
+        Adapt(std::chrono::steady_clock::duration::zero());
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = stop_;
+        if (evicted_flush_id_ > flush_id) {
+          flush_id = evicted_flush_id_;
+        }
+        if (flush_id <= flush_completed_) {
+          flush_id = 0;
+        }
+        if (deferred_flush_id_ != 0) {
+          Record marker{0, Level::kInfo, std::string(), deferred_flush_id_};
+          if (queue_.TryPush(marker)) {
+            deferred_flush_id_ = 0;
+          }
+        }
+      }
+      if (flush_id != 0) {
+        file_.Flush();
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush_completed_ = flush_id;
+        flushed_cv_.notify_all();
+        SignalCompletion();
+      }
+      if (count > 0 || flush_id != 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (blocked_producers_ > 0) {
+          space_cv_.notify_all();
+        }
+        continue;
+      }
+      file_.MaybeFlush();
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stop_ && Empty()) {
+        lock.unlock();
+        ReportShed(std::chrono::steady_clock::now());
+        Record record{internal::CycleClock::Now(), Level::kInfo,
+                      "Closing the log.", 0};
+        AddToBatch(record);
+        WriteBatch(1, Level::kInfo);
+        return;
+      }
+      writer_sleeping_.store(true);
+      if (Empty() && blocked_producers_ == 0 && !stop_ &&
+          (!options_.sharded || flush_requested_ == flush_completed_)) {
+        writer_cv_.wait_for(lock, WakeupInterval());
+      }
+      writer_sleeping_.store(false);
+    }
+  }
+
+  // Writes the queued records with write(2), which is all a crash handler
+  // may do. In sharded mode the queues are written one after the other,
+  // and the records the writer thread has already taken from them are
+  // lost, one per queue at most.
+  void DrainOnCrash() override {
+#ifndef _WIN32
+    int fd = file_.CrashDescriptor();
+    if (fd < 0) {
+      return;
+    }
+    internal::CycleClock::Calibration calibration;
+    bool calibrated = internal::CycleClock::LastCalibration(&calibration);
+    int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+    internal::CrashWriter out(fd);
+    auto write = [&](const Record& record) {
+      if (record.flush_id != 0) {
+        return;
+      }
+      char prefix[kMaxTimestampSize + 16];
+      size_t size = 0;
+      prefix[size++] = '[';
+      size += internal::FormatTimestampAtOffset(
+          calibrated ? calibration.ToNanoseconds(record.ticks) : now_ns,
+          utc_offset_, options_.timestamp_precision, prefix + size);
+      prefix[size++] = ']';
+      prefix[size++] = ' ';
+      out.Append(prefix, size);
+      if (options_.print_level) {
+        const char* name = LevelName(record.level);
+        out.Append("[", 1);
+        out.Append(name, std::strlen(name));
+        out.Append("] ", 2);
+      }
+      out.Append(record.message.data(), record.message.size());
+      out.Append("\n", 1);
+    };
+    if (!options_.sharded) {
+      queue_.Peek(write);
+      return;
+    }
+    // Not shards_, which another thread may be growing.
+    for (std::atomic<Shard*>& slot : crash_shards_) {
+      Shard* shard = slot.load(std::memory_order_acquire);
+      if (shard != nullptr) {
+        shard->queue.Peek(write);
+      }
+    }
+#endif
+  }
+
+  // How long the writer thread sleeps when there is nothing to write, short
+  // enough for the interval flush policy to be honoured.
+  std::chrono::milliseconds WakeupInterval() const {
+    std::chrono::milliseconds wakeup(100);
+    const FlushPolicy& policy = file_.policy();
+    if (policy.interval.count() > 0 && policy.interval < wakeup) {
+      wakeup = policy.interval;
+    }
+    return wakeup;
+  }
+
+  LogFile file_;  // Only used by the writer thread.
+  AsyncFileLoggerOptions options_;
+  BoundedQueue<Record> queue_;  // Unused in sharded mode.
+
+  // Sharded mode. The writer thread works on its own copy of shards_, and
+  // refreshes it when shard_count_ changes.
+  const uint64_t serial_;
+  std::mutex shards_mutex_;
+  std::vector<std::shared_ptr<Shard>> shards_;
+  std::atomic<size_t> shard_count_{0};
+  std::vector<std::shared_ptr<Shard>> writer_shards_;
+  // The first kMaxCrashShards of shards_, for the crash handler.
+  std::atomic<Shard*> crash_shards_[kMaxCrashShards];
+  std::vector<ShardHead> heads_;
+  std::vector<size_t> heap_;
+
+  // Of the local time zone, for timestamps written by the crash handler,
+  // which cannot look it up.
+  const int64_t utc_offset_;
+
+  // The batch the writer thread is collecting. With vectored_writes, the
+  // long messages are in gathered_, and cuts_ holds where in batch_ each of
+  // them goes.
+  internal::LineBuffer batch_;
+  std::vector<std::string> gathered_;
+  std::vector<size_t> cuts_;
+  size_t gathered_bytes_ = 0;
+  std::vector<file::Slice> slices_;
+  std::vector<int64_t> batch_ticks_;  // Of the records in the batch.
+
+  // AdaptivePolicy. Producers read shedding_; the rest is the writer's.
+  size_t batch_limit_;
+  std::atomic<bool> shedding_{false};
+  uint64_t shed_reported_ = 0;  // stats().Shed() at the last report.
+  std::chrono::steady_clock::time_point last_report_;
+
+  // A callback of OnFlushed().
+  struct Completion {
+    uint64_t id;
+    std::function<void()> done;
+  };
+
+  // Guards the condition variables; the queue itself is lock-free.
+  mutable std::mutex mutex_;
+  std::condition_variable writer_cv_;
+  std::condition_variable space_cv_;
+  std::condition_variable flushed_cv_;
+  uint64_t flush_requested_ = 0;
+  uint64_t flush_completed_ = 0;
+  uint64_t evicted_flush_id_ = 0;
+  // A RequestFlush() marker the queue had no room for.
+  uint64_t deferred_flush_id_ = 0;
+  std::vector<Completion> completions_;
+  // Read and write ends of CompletionFd(), the same eventfd on Linux.
+  int completion_fds_[2] = {-1, -1};
+  bool completion_failed_ = false;
+  std::atomic<bool> writer_sleeping_{false};
+  int blocked_producers_ = 0;
+  bool stop_ = false;
+  bool stopping_ = false;  // The writer's copy of stop_.
+
+  std::thread writer_;  // Last, so it starts after everything above.
+};
+
+// Gives the sink it wraps a queue and a thread of its own, so that a slow
+// sink holds up neither the threads that log nor the other sinks of a
+// TeeLogger. The queue only holds pointers to the shared records, which are
+// passed on in batches of up to kMaxBatch.
+class AsyncSink : public Sink {
+ public:
+  static constexpr size_t kMaxBatch = 64;
+
+  explicit AsyncSink(std::shared_ptr<Sink> sink, size_t capacity = 8192,
+                     OverflowPolicy policy = OverflowPolicy::kBlock)
+      : sink_(std::move(sink)),
+        policy_(policy),
+        queue_(capacity),
+        thread_(&AsyncSink::Run, this) {}
+
+  // Passes on every queued record first.
+  ~AsyncSink() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    sink_->Flush();
+  }
+
+  void Consume(const LogRecordPtr& record) override {
+    Item item{record, 0};
+    Push(item, policy_);
+  }
+
+  // Blocks until every record consumed before the call has been passed on
+  // and the wrapped sink flushed.
+  void Flush() override {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = ++flush_requested_;
+    }
+    Item marker{nullptr, id};
+    Push(marker, OverflowPolicy::kBlock);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (flush_completed_ < id) {
+      flushed_cv_.wait(lock);
+    }
+  }
+
+  // Number of records discarded because the queue was full.
+  uint64_t Dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Item {
+    LogRecordPtr record;
+    // Non-zero for the markers pushed by Flush().
+    uint64_t flush_id;
+  };
+
+  // The same overflow handling as AsyncFileLogger.
+  void Push(Item& item, OverflowPolicy policy) {
+    if (!queue_.TryPush(item)) {
+      switch (policy) {
+        case OverflowPolicy::kBlock: {
+          std::unique_lock<std::mutex> lock(mutex_);
+          ++blocked_producers_;
+          cv_.notify_one();
+          while (!queue_.TryPush(item)) {
+            space_cv_.wait_for(lock, std::chrono::milliseconds(1));
+          }
+          --blocked_producers_;
+          break;
+        }
+        case OverflowPolicy::kDropNewest:
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return;
+        case OverflowPolicy::kDropOldest: {
+          Item oldest;
+          do {
+            if (queue_.TryPop(oldest)) {
+              if (oldest.flush_id != 0) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                evicted_flush_id_ = oldest.flush_id;
+              } else {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+              }
+            }
+          } while (!queue_.TryPush(item));
+          break;
+        }
+      }
+    }
+    if (sleeping_.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+
+  void Run() {
+    Item item;
+    LogRecordPtr batch[kMaxBatch];
+    while (true) {
+      bool worked = false;
+      size_t count = 0;
+      while (queue_.TryPop(item)) {
+        worked = true;
+        if (item.flush_id == 0) {
+          batch[count++] = std::move(item.record);
+          if (count < kMaxBatch) {
+            continue;
+          }
+        }
+        PassOn(batch, count);
+        count = 0;
+        if (item.flush_id != 0) {
+          CompleteFlush(item.flush_id);
+        }
+      }
+      PassOn(batch, count);
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (evicted_flush_id_ > flush_completed_) {
+        uint64_t id = evicted_flush_id_;
+        lock.unlock();
+        CompleteFlush(id);
+        lock.lock();
+      }
+      if (worked && blocked_producers_ > 0) {
+        space_cv_.notify_all();
+      }
+      if (stop_ && queue_.Empty()) {
+        return;
+      }
+      sleeping_.store(true);
+      if (queue_.Empty() && blocked_producers_ == 0 && !stop_) {
+        cv_.wait_for(lock, std::chrono::milliseconds(100));
+      }
+      sleeping_.store(false);
+    }
+  }
+
+  void PassOn(LogRecordPtr* batch, size_t count) {
+    if (count == 0) {
+      return;
+    }
+    sink_->ConsumeBatch(batch, count);
+    for (size_t i = 0; i < count; ++i) {
+      batch[i].reset();
+    }
+  }
+
+  void CompleteFlush(uint64_t id) {
+    sink_->Flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (id > flush_completed_) {
+      flush_completed_ = id;
+    }
+    flushed_cv_.notify_all();
+  }
+
+  std::shared_ptr<Sink> sink_;
+  OverflowPolicy policy_;
+  BoundedQueue<Item> queue_;
+  std::atomic<uint64_t> dropped_{0};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable space_cv_;
+  std::condition_variable flushed_cv_;
+  uint64_t flush_requested_ = 0;
+  uint64_t flush_completed_ = 0;
+  uint64_t evicted_flush_id_ = 0;
+  std::atomic<bool> sleeping_{false};
+  int blocked_producers_ = 0;
+  bool stop_ = false;
+
+  std::thread thread_;  // Last, so it starts after everything above.
+};
+
+#endif /* ASYNC_LOGGER_H_ */
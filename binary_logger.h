@@ -0,0 +1,625 @@
+#ifndef BINARY_LOGGER_H_
+#define BINARY_LOGGER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "cycle_clock.h"
+#include "logger.h"
+
+// Layout of the files written by BinaryLogger, in host byte order:
+//
+//   "LOGBIN2\n"
+//   'C' i64 ticks, i64 time, f64 ns_per_tick  calibrates the times below
+//   'F' u32 id, u32 size, format bytes        defines a format string
+//   'R' u32 id, u8 level, i64 ticks, u8 argc, args...
+//   'S' u8 level, i64 ticks, message arg, u8 count, fields...
+//
+// A record's time is the internal::CycleClock tick count at which it was
+// printed. The last calibration before it maps it to nanoseconds since the
+// system_clock epoch: time + (ticks - calibration ticks) * ns_per_tick.
+// There is one at the start of the file, and another about every second
+// while records are printed. (In "LOGBIN1\n" files, which have no
+// calibrations, a record's time is in nanoseconds already.) Every
+// argument is a u8 BinaryArgType followed by its raw bytes; strings are a
+// u32 size followed by the characters. A field of a structured record ('S')
+// is its key, a u32 size and the characters, followed by its value as an
+// argument. Definitions always come before the first record that uses them.
+namespace internal {
+constexpr char kBinaryLogMagic[] = "LOGBIN2\n";
+constexpr char kBinaryLogMagicV1[] = "LOGBIN1\n";
+constexpr size_t kBinaryLogMagicSize = 8;
+constexpr char kBinaryCalibrationTag = 'C';
+constexpr char kBinaryFormatTag = 'F';
+constexpr char kBinaryRecordTag = 'R';
+constexpr char kBinaryStructuredTag = 'S';
+// Format id of records that carry an already formatted message as their only
+// argument.
+constexpr uint32_t kPreformattedId = 0;
+// Argument and field counts are a u8.
+constexpr size_t kMaxBinaryArgs = 255;
+
+enum class BinaryArgType : uint8_t {
+  kInt = 0,     // int64_t
+  kUint = 1,    // uint64_t
+  kDouble = 2,  // double
+  kFloat = 3,   // float
+  kBool = 4,    // uint8_t
+  kChar = 5,    // char
+  kString = 6,  // uint32_t size, then the characters
+};
+
+template <typename T>
+void AppendRaw(LineBuffer& out, const T& value) {
+  std::memcpy(out.Extend(sizeof(T)), &value, sizeof(T));
+  out.Commit(sizeof(T));
+}
+
+inline void AppendBinaryString(LineBuffer& out, StringView str) {
+  out += static_cast<char>(BinaryArgType::kString);
+  AppendRaw(out, static_cast<uint32_t>(str.size()));
+  out.append(str);
+}
+
+// BinaryEncoder<T>::Append(out, value) appends the type tag and raw bytes of
+// `value`. Types the decoder cannot know about are formatted right away and
+// stored as strings.
+template <typename T, typename Enable = void>
+struct BinaryEncoder {
+  static void Append(LineBuffer& out, const T& value) {
+    ScopedLineBuffer text;
+    Formatter<T>::Append(text.get(), value);
+    AppendBinaryString(out, text->view());
+  }
+};
+
+template <typename T>
+struct BinaryEncoder<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value &&
+                               !IsCharacter<T>::value>::type> {
+  static void Append(LineBuffer& out, T value) {
+    out += static_cast<char>(BinaryArgType::kInt);
+    AppendRaw(out, static_cast<int64_t>(value));
+  }
+};
+
+template <typename T>
+struct BinaryEncoder<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value &&
+                               !std::is_same<T, bool>::value &&
+                               !IsCharacter<T>::value>::type> {
+  static void Append(LineBuffer& out, T value) {
+    out += static_cast<char>(BinaryArgType::kUint);
+    AppendRaw(out, static_cast<uint64_t>(value));
+  }
+};
+
+template <typename T>
+struct BinaryEncoder<T,
+                     typename std::enable_if<IsCharacter<T>::value>::type> {
+  static void Append(LineBuffer& out, T value) {
+    out += static_cast<char>(BinaryArgType::kChar);
+    out += static_cast<char>(value);
+  }
+};
+
+template <>
+struct BinaryEncoder<bool> {
+  static void Append(LineBuffer& out, bool value) {
+    out += static_cast<char>(BinaryArgType::kBool);
+    out += static_cast<char>(value ? 1 : 0);
+  }
+};
+
+template <>
+struct BinaryEncoder<double> {
+  static void Append(LineBuffer& out, double value) {
+    out += static_cast<char>(BinaryArgType::kDouble);
+    AppendRaw(out, value);
+  }
+};
+
+template <>
+struct BinaryEncoder<float> {
+  static void Append(LineBuffer& out, float value) {
+    out += static_cast<char>(BinaryArgType::kFloat);
+    AppendRaw(out, value);
+  }
+};
+
+template <>
+struct BinaryEncoder<StringView> {
+  static void Append(LineBuffer& out, StringView value) {
+    AppendBinaryString(out, value);
+  }
+};
+
+template <>
+struct BinaryEncoder<std::string> {
+  static void Append(LineBuffer& out, const std::string& value) {
+    AppendBinaryString(out, value);
+  }
+};
+
+template <>
+struct BinaryEncoder<const char*> {
+  static void Append(LineBuffer& out, const char* value) {
+    AppendBinaryString(out, value == nullptr ? "(null)" : value);
+  }
+};
+
+template <>
+struct BinaryEncoder<char*> : BinaryEncoder<const char*> {};
+
+template <size_t N>
+struct BinaryEncoder<char[N]> : BinaryEncoder<const char*> {};
+
+// A lazy() argument is computed when the record is encoded, and stored
+// with the type of its result.
+template <typename Fn>
+struct BinaryEncoder<LazyValue<Fn>> {
+  static void Append(LineBuffer& out, const LazyValue<Fn>& value) {
+    using Result = typename std::decay<decltype(value())>::type;
+    BinaryEncoder<Result>::Append(out, value());
+  }
+};
+
+inline void EncodeArgs(LineBuffer& /*out*/) {}
+
+template <typename T, typename... Args>
+void EncodeArgs(LineBuffer& out, const T& value, const Args&... args) {
+  BinaryEncoder<T>::Append(out, value);
+  EncodeArgs(out, args...);
+}
+
+inline void EncodeField(LineBuffer& out, const Field& field) {
+  AppendRaw(out, static_cast<uint32_t>(field.key.size()));
+  out.append(field.key);
+  switch (field.type) {
+    case Field::Type::kInt:
+      BinaryEncoder<int64_t>::Append(out, field.int_value);
+      break;
+    case Field::Type::kUint:
+      BinaryEncoder<uint64_t>::Append(out, field.uint_value);
+      break;
+    case Field::Type::kDouble:
+      BinaryEncoder<double>::Append(out, field.double_value);
+      break;
+    case Field::Type::kBool:
+      BinaryEncoder<bool>::Append(out, field.bool_value);
+      break;
+    case Field::Type::kChar:
+      BinaryEncoder<char>::Append(out, field.char_value);
+      break;
+    case Field::Type::kString:
+      AppendBinaryString(out, field.string_value);
+      break;
+    case Field::Type::kOther: {
+      ScopedLineBuffer text;
+      field.AppendValue(text.get());
+      AppendBinaryString(out, text->view());
+      break;
+    }
+  }
+}
+}  // namespace internal
+
+struct BinaryLoggerOptions {
+  std::string mode = "wb";
+  // Records at or above this level are flushed right away; everything else
+  // waits for the stdio buffer, Flush() or close.
+  Level flush_level = Level::kFatal;
+};
+
+// Writes records without formatting them: Print stores the id of its format
+// string, a timestamp and the raw bytes of the arguments in
+// "path/log-<name>.bin". Run log_decoder on the file to get the usual
+// "[time] message" text.
+//
+// The format of Print and Log must be a string literal: formats are
+// recognised by address, so a buffer whose contents change between calls
+// would be decoded with the wrong text. Calls through a Logger& are
+// formatted as usual and stored as text.
+class BinaryLogger : public Logger {
+ public:
+  BinaryLogger(const std::string& path, const std::string& name,
+               const BinaryLoggerOptions& options = BinaryLoggerOptions())
+      : fd_(path + "/log-" + name + ".bin", options.mode),
+        flush_level_(options.flush_level),
+        serial_(NextSerial()) {
+    fd_.Write(internal::kBinaryLogMagic, internal::kBinaryLogMagicSize);
+    WriteCalibration(internal::CycleClock::Now());
+    Print("{} started", name);
+  }
+
+  ~BinaryLogger() override {
+    PrintMessage(Level::kInfo, "Closing the log.");
+  }
+
+  template <typename... Args>
+  void Log(Level level, const char* format, Args&&... args) {
+    if (!IsEnabled(level)) {
+      return;
+    }
+    static_assert(sizeof...(Args) <= internal::kMaxBinaryArgs,
+                  "a binary record holds at most 255 arguments");
+    uint32_t id = FormatId(format);
+    internal::ScopedLineBuffer record;
+    int64_t start = AppendHeader(record.get(), id, level, sizeof...(Args));
+    internal::EncodeArgs(record.get(), args...);
+    Write(record.get(), level, start);
+  }
+
+  template <typename T, typename... Args>
+  void Print(const char* format, T&& value, Args&&... args) {
+    Log(Level::kInfo, format, std::forward<T>(value),
+        std::forward<Args>(args)...);
+  }
+
+  template <typename... Values>
+  void Print(Level level, StringView message,
+             const KeyValue<Values>&... fields) {
+    Logger::Print(level, message, fields...);
+  }
+
+  void Print(const std::string& str) override {
+    PrintMessage(Level::kInfo, str);
+  }
+
+  void PrintMessage(Level level, StringView message) override {
+    internal::ScopedLineBuffer record;
+    int64_t start =
+        AppendHeader(record.get(), internal::kPreformattedId, level, 1);
+    internal::AppendBinaryString(record.get(), message);
+    Write(record.get(), level, start);
+  }
+
+  // Field values keep their types, as arguments do; log_decoder prints the
+  // record as "message key=value ...". Fields past the 255th are dropped.
+  void PrintStructured(Level level, StringView message, const Field* fields,
+                       size_t count) override {
+    count = std::min(count, internal::kMaxBinaryArgs);
+    internal::ScopedLineBuffer record;
+    record.get() += internal::kBinaryStructuredTag;
+    record.get() += static_cast<char>(level);
+    int64_t start = Now();
+    internal::AppendRaw(record.get(), start);
+    internal::AppendBinaryString(record.get(), message);
+    record.get() += static_cast<char>(count);
+    for (size_t i = 0; i < count; ++i) {
+      internal::EncodeField(record.get(), fields[i]);
+    }
+    Write(record.get(), level, start);
+  }
+
+  void Flush() override {
+    bool ok = fd_.Flush();
+    stats().AddFlush();
+    if (!ok) {
+      stats().AddWriteError();
+    }
+  }
+
+ private:
+  // Direct-mapped per-thread cache from format address to id, so the common
+  // case does not take the lock.
+  struct CacheEntry {
+    uint64_t serial = 0;
+    const char* format = nullptr;
+    uint32_t id = 0;
+  };
+  static constexpr size_t kCacheSize = 256;
+
+  static uint64_t NextSerial() {
+    static std::atomic<uint64_t> serial(0);
+    return ++serial;
+  }
+
+  uint32_t FormatId(const char* format) {
+    static thread_local CacheEntry cache[kCacheSize];
+    CacheEntry& entry =
+        cache[(reinterpret_cast<uintptr_t>(format) >> 3) % kCacheSize];
+    if (entry.serial == serial_ && entry.format == format) {
+      return entry.id;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ids_.find(format);
+    if (it == ids_.end()) {
+      uint32_t id = static_cast<uint32_t>(ids_.size()) + 1;
+      it = ids_.emplace(format, id).first;
+      internal::ScopedLineBuffer definition;
+      size_t size = std::strlen(format);
+      definition.get() += internal::kBinaryFormatTag;
+      internal::AppendRaw(definition.get(), id);
+      internal::AppendRaw(definition.get(), static_cast<uint32_t>(size));
+      definition->append(format, size);
+      fd_.Write(definition->data(), definition->size());
+    }
+    entry.serial = serial_;
+    entry.format = format;
+    entry.id = it->second;
+    return entry.id;
+  }
+
+  // The tick count for a record, after writing a new calibration if the
+  // last one is a second old.
+  int64_t Now() {
+    int64_t ticks = internal::CycleClock::Now();
+    if (ticks >= next_calibration_.load(std::memory_order_relaxed)) {
+      WriteCalibration(ticks);
+    }
+    return ticks;
+  }
+
+  void WriteCalibration(int64_t ticks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ticks < next_calibration_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    internal::CycleClock::Calibration calibration =
+        internal::CycleClock::Calibrate(ticks);
+    internal::ScopedLineBuffer record;
+    record.get() += internal::kBinaryCalibrationTag;
+    internal::AppendRaw(record.get(), calibration.ticks);
+    internal::AppendRaw(record.get(), calibration.wall_ns);
+    internal::AppendRaw(record.get(), calibration.ns_per_tick);
+    fd_.Write(record->data(), record->size());
+    next_calibration_.store(
+        calibration.ticks +
+            static_cast<int64_t>(1e9 / calibration.ns_per_tick),
+        std::memory_order_relaxed);
+  }
+
+  // Returns the tick count of the record.
+  int64_t AppendHeader(internal::LineBuffer& out, uint32_t id, Level level,
+                       size_t argc) {
+    out += internal::kBinaryRecordTag;
+    internal::AppendRaw(out, id);
+    out += static_cast<char>(level);
+    int64_t ticks = Now();
+    internal::AppendRaw(out, ticks);
+    out += static_cast<char>(argc);
+    return ticks;
+  }
+
+  // `start` is the tick count in the record.
+  void Write(const internal::LineBuffer& record, Level level, int64_t start) {
+    // One fwrite per record keeps records whole across threads.
+    if (fd_.Write(record.data(), record.size())) {
+      stats().AddBytes(record.size());
+    } else {
+      stats().AddWriteError();
+    }
+    if (level >= flush_level_) {
+      Flush();
+    }
+    stats().AddRecords(1);
+    stats().AddProducerLatency(internal::CycleClock::Now() - start);
+  }
+
+  file::File fd_;
+  Level flush_level_;
+  const uint64_t serial_;
+  std::mutex mutex_;  // Guards ids_ and the order of definitions.
+  std::unordered_map<const char*, uint32_t> ids_;
+  std::atomic<int64_t> next_calibration_{0};
+};
+
+// Turns a file written by BinaryLogger back into "[time] message" lines,
+// reading it through a file::MappedView.
+class BinaryLogReader {
+ public:
+  explicit BinaryLogReader(
+      const std::string& filename,
+      TimestampPrecision precision = TimestampPrecision::kMilliseconds)
+      : file_(filename),
+        data_(file_.view()),
+        pos_(internal::kBinaryLogMagicSize),
+        precision_(precision) {
+    StringView magic = data_.substr(0, internal::kBinaryLogMagicSize);
+    ticks_ = magic == StringView(internal::kBinaryLogMagic,
+                                 internal::kBinaryLogMagicSize);
+    ok_ = ticks_ || magic == StringView(internal::kBinaryLogMagicV1,
+                                        internal::kBinaryLogMagicSize);
+    formats_[internal::kPreformattedId] = "{}";
+  }
+
+  // Replaces `line` with the next record, without the trailing newline.
+  // Returns false at the end of the file or if the file is corrupt.
+  bool Next(internal::LineBuffer& line) {
+    line.clear();
+    while (ok_ && pos_ < data_.size()) {
+      char tag = data_[pos_++];
+      if (tag == internal::kBinaryFormatTag) {
+        uint32_t id, size;
+        if (!Read(&id) || !Read(&size) || !Has(size)) {
+          return Fail();
+        }
+        formats_[id] = data_.substr(pos_, size).ToString();
+        pos_ += size;
+      } else if (tag == internal::kBinaryCalibrationTag) {
+        if (!Read(&calibration_.ticks) || !Read(&calibration_.wall_ns) ||
+            !Read(&calibration_.ns_per_tick)) {
+          return Fail();
+        }
+        calibrated_ = true;
+      } else if (tag == internal::kBinaryRecordTag) {
+        return ReadRecord(line);
+      } else if (tag == internal::kBinaryStructuredTag) {
+        return ReadStructured(line);
+      } else {
+        return Fail();
+      }
+    }
+    return false;
+  }
+
+  // False once corrupt or truncated data was found.
+  bool ok() const { return ok_; }
+
+ private:
+  bool ReadRecord(internal::LineBuffer& line) {
+    uint32_t id;
+    uint8_t level, argc;
+    int64_t time;
+    if (!Read(&id) || !Read(&level) || !Read(&time) || !Read(&argc)) {
+      return Fail();
+    }
+    auto format = formats_.find(id);
+    if (format == formats_.end()) {
+      return Fail();
+    }
+
+    if (!AppendTime(line, time)) {
+      return Fail();
+    }
+
+    // The same substitution rules as internal::StrFormat.
+    StringView rest(format->second);
+    for (uint8_t i = 0; i < argc; ++i) {
+      size_t pos = rest.find("{}");
+      if (pos != StringView::npos) {
+        line.append(rest.data(), pos);
+        rest = rest.substr(pos + 2);
+      }
+      if (!AppendArg(line, pos != StringView::npos)) {
+        return Fail();
+      }
+    }
+    line += rest;
+    return true;
+  }
+
+  bool ReadStructured(internal::LineBuffer& line) {
+    uint8_t level, count;
+    int64_t time;
+    if (!Read(&level) || !Read(&time)) {
+      return Fail();
+    }
+    if (!AppendTime(line, time)) {
+      return Fail();
+    }
+    if (!AppendArg(line, true) || !Read(&count)) {
+      return Fail();
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+      uint32_t size;
+      if (!Read(&size) || !Has(size)) {
+        return Fail();
+      }
+      line += ' ';
+      line.append(data_.data() + pos_, size);
+      pos_ += size;
+      line += '=';
+      internal::ScopedLineBuffer value;
+      if (!AppendArg(value.get(), true)) {
+        return Fail();
+      }
+      internal::AppendLogfmtValue(line, value->view());
+    }
+    return true;
+  }
+
+  // False if the time is in ticks and no calibration has come yet.
+  bool AppendTime(internal::LineBuffer& line, int64_t time) {
+    if (ticks_) {
+      if (!calibrated_) {
+        return false;
+      }
+      time = calibration_.ToNanoseconds(time);
+    }
+    line += '[';
+    line.Commit(internal::FormatTimestamp(
+        std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(time))),
+        line.Extend(kMaxTimestampSize), precision_));
+    line += "] ";
+    return true;
+  }
+
+  // Reads one argument, and appends it if `print` is set.
+  bool AppendArg(internal::LineBuffer& line, bool print) {
+    uint8_t type;
+    if (!Read(&type)) {
+      return false;
+    }
+    internal::ScopedLineBuffer ignored;
+    internal::LineBuffer& out = print ? line : ignored.get();
+    switch (static_cast<internal::BinaryArgType>(type)) {
+      case internal::BinaryArgType::kInt:
+        return ReadAndAppend<int64_t>(out);
+      case internal::BinaryArgType::kUint:
+        return ReadAndAppend<uint64_t>(out);
+      case internal::BinaryArgType::kDouble:
+        return ReadAndAppend<double>(out);
+      case internal::BinaryArgType::kFloat:
+        return ReadAndAppend<float>(out);
+      case internal::BinaryArgType::kBool:
+        return ReadAndAppend<bool>(out);
+      case internal::BinaryArgType::kChar:
+        return ReadAndAppend<char>(out);
+      case internal::BinaryArgType::kString: {
+        uint32_t size;
+        if (!Read(&size) || !Has(size)) {
+          return false;
+        }
+        out.append(data_.data() + pos_, size);
+        pos_ += size;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename T>
+  bool ReadAndAppend(internal::LineBuffer& out) {
+    T value;
+    if (!Read(&value)) {
+      return false;
+    }
+    internal::AppendValue(out, value);
+    return true;
+  }
+
+  bool Has(size_t size) const { return data_.size() - pos_ >= size; }
+
+  template <typename T>
+  bool Read(T* value) {
+    if (!Has(sizeof(T))) {
+      return false;
+    }
+    std::memcpy(value, data_.data() + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  bool Fail() {
+    ok_ = false;
+    return false;
+  }
+
+  file::MappedView file_;
+  StringView data_;
+  size_t pos_;
+  TimestampPrecision precision_;
+  bool ok_;
+  // Whether record times are ticks, and the calibration for them.
+  bool ticks_;
+  bool calibrated_ = false;
+  internal::CycleClock::Calibration calibration_;
+  std::unordered_map<uint32_t, std::string> formats_;
+};
+
+#endif /* BINARY_LOGGER_H_ */
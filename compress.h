@@ -0,0 +1,356 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "file.h"
+#include "utils.h"
+
+// A small LZ77 compressor for log files, in the spirit of LZ4: no entropy
+// coding, just literal runs and back-references, which is fast and already
+// shrinks repetitive log text several times.
+//
+// Compressed files start with kMagic and hold a sequence of frames:
+//
+//   u32 raw size, u32 stored size, stored bytes
+//
+// in host byte order. If the top bit of the stored size is set the block is
+// stored uncompressed. Every frame decodes on its own, so a file that is
+// still being written can be read up to its last complete frame.
+namespace compress {
+constexpr char kMagic[] = "LOGLZ01\n";
+constexpr size_t kMagicSize = 8;
+// Largest block; offsets then fit in 16 bits.
+constexpr size_t kBlockSize = 64 * 1024;
+constexpr uint32_t kStoredFlag = 0x80000000u;
+
+namespace internal {
+constexpr int kHashBits = 13;
+constexpr size_t kMinMatch = 4;
+// The last bytes of a block are always literals, which keeps the decoder's
+// copies simple.
+constexpr size_t kLastLiterals = 5;
+
+inline uint32_t Load32(const char* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t Hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+// Appends `length` in the 4-bit-token-plus-255-continuation encoding.
+inline void AppendLength(std::string& out, size_t length) {
+  while (length >= 255) {
+    out += static_cast<char>(255);
+    length -= 255;
+  }
+  out += static_cast<char>(length);
+}
+
+inline void AppendSequence(std::string& out, const char* literals,
+                           size_t literal_size, size_t offset,
+                           size_t match_size) {
+  size_t match_code = match_size == 0 ? 0 : match_size - kMinMatch;
+  unsigned char token =
+      static_cast<unsigned char>((literal_size < 15 ? literal_size : 15) << 4 |
+                                 (match_code < 15 ? match_code : 15));
+  out += static_cast<char>(token);
+  if (literal_size >= 15) {
+    AppendLength(out, literal_size - 15);
+  }
+  out.append(literals, literal_size);
+  if (match_size == 0) {
+    return;
+  }
+  out += static_cast<char>(offset & 0xff);
+  out += static_cast<char>(offset >> 8);
+  if (match_code >= 15) {
+    AppendLength(out, match_code - 15);
+  }
+}
+
+inline bool ReadLength(const unsigned char*& in, const unsigned char* end,
+                       size_t& length) {
+  unsigned char byte;
+  do {
+    if (in == end) {
+      return false;
+    }
+    byte = *in++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+}  // namespace internal
+
+// Appends the compressed form of `size` (at most kBlockSize) bytes.
+inline void CompressBlock(const char* src, size_t size, std::string& out) {
+  SPIEL_CHECK_LE(size, kBlockSize);
+  uint32_t table[1 << internal::kHashBits];
+  std::memset(table, 0, sizeof(table));
+
+  const char* anchor = src;
+  const char* end = src + size;
+  if (size > internal::kLastLiterals + internal::kMinMatch) {
+    const char* match_limit = end - internal::kLastLiterals;
+    const char* ip = src + 1;
+    while (ip + internal::kMinMatch <= match_limit) {
+      uint32_t sequence = internal::Load32(ip);
+      uint32_t& slot = table[internal::Hash(sequence)];
+      const char* candidate = src + slot;
+      slot = static_cast<uint32_t>(ip - src);
+      if (candidate >= ip || internal::Load32(candidate) != sequence) {
+        ++ip;
+        continue;
+      }
+      // Extend the match forward.
+      const char* match_end = ip + internal::kMinMatch;
+      const char* ref = candidate + internal::kMinMatch;
+      while (match_end < match_limit && *match_end == *ref) {
+        ++match_end;
+        ++ref;
+      }
+      internal::AppendSequence(out, anchor, ip - anchor, ip - candidate,
+                               match_end - ip);
+      ip = anchor = match_end;
+    }
+  }
+  internal::AppendSequence(out, anchor, end - anchor, 0, 0);
+}
+
+// Decompresses a block produced by CompressBlock into exactly `raw_size`
+// bytes at `dst`. Returns false on corrupt input.
+inline bool DecompressBlock(const char* src, size_t size, char* dst,
+                            size_t raw_size) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+  const unsigned char* in_end = in + size;
+  char* out = dst;
+  char* out_end = dst + raw_size;
+  while (in < in_end) {
+    unsigned char token = *in++;
+    size_t literal_size = token >> 4;
+    if (literal_size == 15 &&
+        !internal::ReadLength(in, in_end, literal_size)) {
+      return false;
+    }
+    if (static_cast<size_t>(in_end - in) < literal_size ||
+        static_cast<size_t>(out_end - out) < literal_size) {
+      return false;
+    }
+    std::memcpy(out, in, literal_size);
+    in += literal_size;
+    out += literal_size;
+    if (in == in_end) {
+      break;  // The last sequence has no match.
+    }
+
+    if (in_end - in < 2) {
+      return false;
+    }
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t match_size = token & 15;
+    if (match_size == 15 && !internal::ReadLength(in, in_end, match_size)) {
+      return false;
+    }
+    match_size += internal::kMinMatch;
+    if (offset == 0 || static_cast<size_t>(out - dst) < offset ||
+        static_cast<size_t>(out_end - out) < match_size) {
+      return false;
+    }
+    // Byte by byte: the match may overlap what it is copying.
+    const char* ref = out - offset;
+    for (size_t i = 0; i < match_size; ++i) {
+      out[i] = ref[i];
+    }
+    out += match_size;
+  }
+  return out == out_end;
+}
+
+// Appends one frame holding `size` (at most kBlockSize) bytes.
+inline void AppendFrame(const char* data, size_t size, std::string& out) {
+  size_t header = out.size();
+  out.append(8, '\0');
+  CompressBlock(data, size, out);
+  uint32_t raw_size = static_cast<uint32_t>(size);
+  uint32_t stored_size = static_cast<uint32_t>(out.size() - header - 8);
+  if (stored_size >= size) {
+    out.resize(header + 8);
+    out.append(data, size);
+    stored_size = raw_size | kStoredFlag;
+  }
+  std::memcpy(&out[header], &raw_size, 4);
+  std::memcpy(&out[header + 4], &stored_size, 4);
+}
+
+// A file written as compressed frames. Writes are collected into blocks of
+// kBlockSize; Flush() also writes out a partial block, so everything
+// flushed can be decoded while the file is still open.
+class CompressedFile {
+ public:
+  // `mode` is "w" to truncate or "a" to append frames to an existing file.
+  CompressedFile(const std::string& filename, const std::string& mode)
+      : fd_(filename, mode == "a" ? "ab" : "wb") {
+    if (mode != "a" || file::Size(filename) <= 0) {
+      fd_.Write(kMagic, kMagicSize);
+    }
+    block_.reserve(kBlockSize);
+  }
+
+  CompressedFile(const CompressedFile&) = delete;
+  CompressedFile& operator=(const CompressedFile&) = delete;
+
+  ~CompressedFile() { Flush(); }
+
+  bool Write(const char* data, size_t size) {
+    bool ok = true;
+    while (size > 0) {
+      size_t count = kBlockSize - block_.size();
+      if (count > size) {
+        count = size;
+      }
+      block_.append(data, count);
+      data += count;
+      size -= count;
+      if (block_.size() == kBlockSize) {
+        ok = WriteBlock() && ok;
+      }
+    }
+    return ok;
+  }
+
+  bool Flush() {
+    bool ok = block_.empty() || WriteBlock();
+    return fd_.Flush() && ok;
+  }
+
+ private:
+  bool WriteBlock() {
+    frame_.clear();
+    AppendFrame(block_.data(), block_.size(), frame_);
+    block_.clear();
+    return fd_.Write(frame_);
+  }
+
+  file::File fd_;
+  std::string block_;
+  std::string frame_;
+};
+
+// Reads the frames of a compressed file one block at a time. Next() stops
+// at a frame that is not complete yet, so calling it again later picks up
+// frames appended in the meantime.
+class BlockReader {
+ public:
+  explicit BlockReader(const std::string& filename)
+      : fd_(filename, "rb"), ok_(fd_.Read(kMagicSize) == kMagic) {
+    if (!ok_) {
+      // Maybe the magic has not been written yet.
+      fd_.Seek(0);
+    }
+  }
+
+  // Appends the next block to `out`. Returns false if there is no complete
+  // frame yet, or the data is corrupt (see ok()).
+  bool Next(std::string& out) {
+    if (corrupt_) {
+      return false;
+    }
+    if (!ok_) {
+      if (fd_.Length() < static_cast<std::int64_t>(kMagicSize)) {
+        return false;
+      }
+      fd_.Seek(0);
+      ok_ = fd_.Read(kMagicSize) == kMagic;
+      corrupt_ = !ok_;
+      if (!ok_) {
+        return false;
+      }
+    }
+    std::int64_t start = fd_.Tell();
+    std::string header = fd_.Read(8);
+    if (header.size() < 8) {
+      fd_.Seek(start);
+      return false;
+    }
+    uint32_t raw_size, stored_size;
+    std::memcpy(&raw_size, header.data(), 4);
+    std::memcpy(&stored_size, header.data() + 4, 4);
+    bool stored = (stored_size & kStoredFlag) != 0;
+    stored_size &= ~kStoredFlag;
+    if (raw_size > kBlockSize || stored_size > kBlockSize * 2) {
+      return Fail();
+    }
+    std::string data = fd_.Read(stored_size);
+    if (data.size() < stored_size) {
+      fd_.Seek(start);
+      return false;
+    }
+    if (stored) {
+      if (stored_size != raw_size) {
+        return Fail();
+      }
+      out += data;
+      return true;
+    }
+    size_t offset = out.size();
+    out.resize(offset + raw_size);
+    if (!DecompressBlock(data.data(), data.size(), &out[offset], raw_size)) {
+      out.resize(offset);
+      return Fail();
+    }
+    return true;
+  }
+
+  // False once corrupt data was found.
+  bool ok() const { return !corrupt_; }
+
+ private:
+  bool Fail() {
+    corrupt_ = true;
+    ok_ = false;
+    return false;
+  }
+
+  file::File fd_;
+  bool ok_;
+  bool corrupt_ = false;
+};
+
+// Does the file start with kMagic?
+inline bool IsCompressed(const std::string& filename) {
+  if (file::Size(filename) < static_cast<std::int64_t>(kMagicSize)) {
+    return false;
+  }
+  file::File f(filename, "rb");
+  return f.Read(kMagicSize) == kMagic;
+}
+
+// Writes a compressed copy of `from` to `to`. Returns false if `from` does
+// not exist.
+inline bool CompressFile(const std::string& from, const std::string& to) {
+  if (!file::Exists(from)) {
+    return false;
+  }
+  file::File in(from, "rb");
+  CompressedFile out(to, "w");
+  while (true) {
+    std::string block = in.Read(kBlockSize);
+    if (block.empty()) {
+      break;
+    }
+    if (!out.Write(block.data(), block.size())) {
+      return false;
+    }
+  }
+  return out.Flush();
+}
+}  // namespace compress
+
+#endif /* COMPRESS_H_ */
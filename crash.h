@@ -0,0 +1,250 @@
+#ifndef CRASH_H_
+#define CRASH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+// Saving what the loggers hold in memory when the process dies. Log files
+// and async loggers register themselves in a fixed table; on a fatal error
+// or signal, DrainLoggersOnCrash() has each of them write out its buffers
+// with write(2) or pwrite(2), taking no lock and allocating nothing, so it
+// is safe in a signal handler and cannot deadlock on a logger whose lock
+// the crashing thread holds. For this, log files keep their lines in
+// buffers of their own rather than in stdio's (see FileOptions::unlocked):
+// a stdio buffer cannot be written out from a signal handler. The default
+// SpielFatalError handler calls it before exiting; InstallCrashHandler()
+// does so on SIGSEGV, SIGABRT and the like.
+//
+// Draining is best effort: the other threads keep running meanwhile. Log
+// files wait a little for a write in progress and then take no more, so
+// lines logged after the crash are lost, and so may be a batch that is
+// still being written when the wait runs out.
+
+namespace internal {
+// Something the crash handler drains.
+class CrashDrainable {
+ public:
+  virtual ~CrashDrainable() = default;
+  // Writes out what is held in memory. Runs at most once, maybe in a
+  // signal handler that interrupted any other call on the object, so it
+  // may only use async-signal-safe calls.
+  virtual void DrainOnCrash() = 0;
+};
+
+class CrashRegistry {
+ public:
+  // Loggers beyond this many are not drained.
+  enum : size_t { kMaxEntries = 256 };
+
+  static void Register(CrashDrainable* entry) {
+    for (std::atomic<CrashDrainable*>& slot : State().entries) {
+      CrashDrainable* empty = nullptr;
+      if (slot.compare_exchange_strong(empty, entry)) {
+        return;
+      }
+    }
+  }
+
+  static void Unregister(CrashDrainable* entry) {
+    for (std::atomic<CrashDrainable*>& slot : State().entries) {
+      CrashDrainable* expected = entry;
+      if (slot.compare_exchange_strong(expected, nullptr)) {
+        return;
+      }
+    }
+  }
+
+  // Drains every registered entry, oldest first. Only the first call does
+  // so; a call from another thread meanwhile waits for it to finish, for
+  // up to a few seconds.
+  static void Drain() {
+    Registry& state = State();
+    if (state.started.exchange(true)) {
+      for (int i = 0; i < 5000 && !state.finished.load(); ++i) {
+        SleepMillisecond();
+      }
+      return;
+    }
+    for (std::atomic<CrashDrainable*>& slot : state.entries) {
+      CrashDrainable* entry = slot.load();
+      if (entry != nullptr) {
+        entry->DrainOnCrash();
+      }
+    }
+    state.finished.store(true);
+  }
+
+  // Has Drain() been called? Log files then take no more writes.
+  static bool Drained() { return State().started.load(); }
+
+  // Is Drain() running? Async loggers do not take records from their
+  // queues meanwhile, since it is writing them out.
+  static bool Draining() {
+    Registry& state = State();
+    return state.started.load() && !state.finished.load();
+  }
+
+  // Waits up to 100 ms for `busy` to clear, e.g. for the write in progress
+  // when the crash came, and returns whether it did. Not for ever, since
+  // the thread that crashed may be the one writing.
+  static bool WaitWhile(const std::atomic<bool>& busy) {
+    for (int i = 0; i < 100 && busy.load(); ++i) {
+      SleepMillisecond();
+    }
+    return !busy.load();
+  }
+
+ private:
+  // Constant-initialized, so there is no guard to take in a signal handler.
+  struct Registry {
+    std::atomic<CrashDrainable*> entries[kMaxEntries];
+    std::atomic<bool> started;
+    std::atomic<bool> finished;
+  };
+
+  static Registry& State() {
+    static Registry state = {};
+    return state;
+  }
+
+  static void SleepMillisecond() {
+#ifndef _WIN32
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, nullptr);
+#endif
+  }
+};
+
+#ifndef _WIN32
+// Writes lines to a descriptor through a buffer on the stack, retrying
+// partial writes. Async-signal-safe.
+class CrashWriter {
+ public:
+  explicit CrashWriter(int fd) : fd_(fd) {}
+  CrashWriter(const CrashWriter&) = delete;
+  CrashWriter& operator=(const CrashWriter&) = delete;
+  ~CrashWriter() { Flush(); }
+
+  void Append(const char* data, size_t size) {
+    while (size > 0) {
+      if (size_ == sizeof(buffer_)) {
+        Flush();
+      }
+      size_t count = sizeof(buffer_) - size_;
+      if (count > size) {
+        count = size;
+      }
+      std::memcpy(buffer_ + size_, data, count);
+      size_ += count;
+      data += count;
+      size -= count;
+    }
+  }
+
+  void Flush() {
+    const char* data = buffer_;
+    while (size_ > 0) {
+      ssize_t written = ::write(fd_, data, size_);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      data += written;
+      size_ -= written;
+    }
+    size_ = 0;
+  }
+
+ private:
+  int fd_;
+  size_t size_ = 0;
+  char buffer_[4096];
+};
+
+// The signals InstallCrashHandler() catches, and what was installed for
+// them before.
+struct CrashSignals {
+  enum : size_t { kCount = 5 };
+
+  static const int* Numbers() {
+    static const int numbers[kCount] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                        SIGABRT};
+    return numbers;
+  }
+
+  static struct sigaction* Previous() {
+    static struct sigaction previous[kCount];
+    return previous;
+  }
+
+  // Drains the loggers, then puts back the previous handler and raises the
+  // signal again for it, or for the default action, to end the process.
+  static void Handle(int signal) {
+    int saved_errno = errno;
+    CrashRegistry::Drain();
+    for (size_t i = 0; i < kCount; ++i) {
+      if (Numbers()[i] == signal) {
+        sigaction(signal, &Previous()[i], nullptr);
+      }
+    }
+    errno = saved_errno;
+    raise(signal);
+  }
+};
+#endif
+}  // namespace internal
+
+// Writes out what the registered loggers hold in memory: the stdio and
+// direct-I/O buffers of their files and the queues of async loggers. Meant
+// for a process that is about to die: the files write nothing more
+// afterwards. Async-signal-safe, so a custom error or signal handler can
+// call it.
+inline void DrainLoggersOnCrash() { internal::CrashRegistry::Drain(); }
+
+// Drains the loggers on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT before
+// the handler installed before, or the default action, takes over. Call it
+// early in main(); later calls do nothing. The handler runs on an
+// alternate stack, so that it also works after a stack overflow; that stack
+// is set up for the calling thread only. Returns false where this is not
+// supported (Windows).
+inline bool InstallCrashHandler() {
+#ifdef _WIN32
+  return false;
+#else
+  static std::atomic<bool> installed{false};
+  if (installed.exchange(true)) {
+    return true;
+  }
+  static char alternate_stack[64 << 10];
+  stack_t stack;
+  std::memset(&stack, 0, sizeof(stack));
+  stack.ss_sp = alternate_stack;
+  stack.ss_size = sizeof(alternate_stack);
+  bool ok = sigaltstack(&stack, nullptr) == 0;
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = &internal::CrashSignals::Handle;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (size_t i = 0; i < internal::CrashSignals::kCount; ++i) {
+    ok = sigaction(internal::CrashSignals::Numbers()[i], &action,
+                   &internal::CrashSignals::Previous()[i]) == 0 &&
+         ok;
+  }
+  return ok;
+#endif
+}
+
+#endif /* CRASH_H_ */
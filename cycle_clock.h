@@ -0,0 +1,248 @@
+#ifndef CYCLE_CLOCK_H_
+#define CYCLE_CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// The cycle counter read by CycleClock: rdtsc on x86, cntvct_el0 on 64-bit
+// ARM. Define LOGGER_NO_CYCLE_CLOCK to always use steady_clock instead.
+#ifndef LOGGER_NO_CYCLE_CLOCK
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define LOGGER_CYCLE_CLOCK_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#elif defined(__aarch64__)
+#define LOGGER_CYCLE_CLOCK_ARM64 1
+#endif
+#endif
+
+namespace internal {
+// Timestamps for the threads that log, taken as a raw tick count and turned
+// into wall-clock time later by whoever formats the record: an rdtsc is a
+// few nanoseconds, against tens for system_clock::now() even through the
+// vDSO.
+//
+// Ticks are cycles of the invariant TSC, or of the ARM generic timer, which
+// run at a fixed rate whatever the CPU frequency and are synchronized across
+// cores. Without one, e.g. on a CPU or VM that does not report an invariant
+// TSC, ticks are steady_clock nanoseconds. Either way, a calibration maps
+// ticks to system_clock time. It is taken anew every second on demand, so
+// that the mapping follows adjustments of the wall clock, with the tick
+// rate measured since the first one.
+class CycleClock {
+ public:
+  struct Calibration {
+    int64_t ticks = 0;
+    int64_t wall_ns = 0;  // system_clock nanoseconds at `ticks`.
+    double ns_per_tick = 1;
+
+    int64_t ToNanoseconds(int64_t at) const {
+      return wall_ns + static_cast<int64_t>((at - ticks) * ns_per_tick);
+    }
+  };
+
+  // Are ticks cycles, rather than steady_clock nanoseconds?
+  static bool UsesCycleCounter() {
+    static const bool uses = HasInvariantCounter();
+    return uses;
+  }
+
+  static int64_t Now() {
+#if defined(LOGGER_CYCLE_CLOCK_X86) || defined(LOGGER_CYCLE_CLOCK_ARM64)
+    if (UsesCycleCounter()) {
+      return ReadCounter();
+    }
+#endif
+    return SteadyNanoseconds();
+  }
+
+  // The calibration for ticks around `at`, taken anew if the last one is
+  // more than a second older.
+  static Calibration Calibrate(int64_t at) {
+    State& state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (at >= state.recalibrate_at) {
+      state.Recalibrate();
+    }
+    return state.current;
+  }
+
+  // Converts ticks from Now() to wall-clock time. The calling thread keeps
+  // a copy of the calibration, so this only locks about once a second.
+  static std::chrono::system_clock::time_point ToTime(int64_t at) {
+    static thread_local Calibration calibration;
+    static thread_local int64_t valid_until = 0;
+    if (at >= valid_until) {
+      calibration = Calibrate(at);
+      valid_until = calibration.ticks +
+                    static_cast<int64_t>(1e9 / calibration.ns_per_tick);
+    }
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(calibration.ToNanoseconds(at))));
+  }
+
+  // The last calibration taken, without locking, for a crash handler.
+  // Returns false if there is none yet, or if it is being replaced, which
+  // may be by the very thread the handler interrupted.
+  static bool LastCalibration(Calibration* out) {
+    Published& published = GetPublished();
+    uint64_t version = published.version.load(std::memory_order_acquire);
+    if (version == 0 || version % 2 != 0) {
+      return false;
+    }
+    // Acquire, so that the version is read again after them.
+    out->ticks = published.ticks.load(std::memory_order_acquire);
+    out->wall_ns = published.wall_ns.load(std::memory_order_acquire);
+    out->ns_per_tick = published.ns_per_tick.load(std::memory_order_acquire);
+    return published.version.load(std::memory_order_relaxed) == version;
+  }
+
+ private:
+  static int64_t SteadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static int64_t WallNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+#if defined(LOGGER_CYCLE_CLOCK_X86)
+  static int64_t ReadCounter() { return static_cast<int64_t>(__rdtsc()); }
+
+  // CPUID 0x80000007, EDX bit 8: the TSC runs at a constant rate in every
+  // ACPI P-, C- and T-state.
+  static bool HasInvariantCounter() {
+    unsigned regs[4] = {0, 0, 0, 0};
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0x80000000);
+    if (static_cast<unsigned>(info[0]) < 0x80000007u) {
+      return false;
+    }
+    __cpuid(info, 0x80000007);
+    regs[3] = static_cast<unsigned>(info[3]);
+#else
+    if (__get_cpuid_max(0x80000000u, nullptr) < 0x80000007u ||
+        !__get_cpuid(0x80000007u, &regs[0], &regs[1], &regs[2], &regs[3])) {
+      return false;
+    }
+#endif
+    return (regs[3] & (1u << 8)) != 0;
+  }
+#elif defined(LOGGER_CYCLE_CLOCK_ARM64)
+  static int64_t ReadCounter() {
+    int64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+  }
+
+  // The generic timer always runs at the fixed rate of cntfrq_el0.
+  static bool HasInvariantCounter() { return true; }
+#else
+  static bool HasInvariantCounter() { return false; }
+#endif
+
+  // Ticks, steady_clock and system_clock nanoseconds at about the same time.
+  struct Sample {
+    int64_t ticks;
+    int64_t steady_ns;
+    int64_t wall_ns;
+  };
+
+  // Reads the clocks between two tick readings, taking the closest of a few
+  // tries so that an interrupt in the middle does not skew the sample.
+  static Sample TakeSample() {
+    Sample best = {0, 0, 0};
+    int64_t best_gap = -1;
+    for (int i = 0; i < 5; ++i) {
+      int64_t before = Now();
+      int64_t steady = SteadyNanoseconds();
+      int64_t wall = WallNanoseconds();
+      int64_t after = Now();
+      if (best_gap < 0 || after - before < best_gap) {
+        best_gap = after - before;
+        best = Sample{before + (after - before) / 2, steady, wall};
+      }
+    }
+    return best;
+  }
+
+  struct State {
+    State() {
+      first = TakeSample();
+      if (UsesCycleCounter()) {
+        // An estimate of the rate to start with, refined as time passes.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      Recalibrate();
+    }
+
+    void Recalibrate() {
+      Sample sample = TakeSample();
+      current.ticks = sample.ticks;
+      current.wall_ns = sample.wall_ns;
+      if (UsesCycleCounter() && sample.ticks > first.ticks) {
+        current.ns_per_tick =
+            static_cast<double>(sample.steady_ns - first.steady_ns) /
+            (sample.ticks - first.ticks);
+      }
+      recalibrate_at =
+          sample.ticks + static_cast<int64_t>(1e9 / current.ns_per_tick);
+      Publish(current);
+    }
+
+    std::mutex mutex;
+    Sample first;
+    Calibration current;
+    int64_t recalibrate_at = 0;
+  };
+
+  static State& GetState() {
+    static State state;
+    return state;
+  }
+
+  // A copy of the current calibration behind a sequence lock: the version
+  // is odd while it is being written.
+  struct Published {
+    std::atomic<uint64_t> version;
+    std::atomic<int64_t> ticks;
+    std::atomic<int64_t> wall_ns;
+    std::atomic<double> ns_per_tick;
+  };
+
+  // Constant-initialized, so there is no guard to take in a signal handler.
+  static Published& GetPublished() {
+    static Published published = {};
+    return published;
+  }
+
+  // Called with the state's mutex held.
+  static void Publish(const Calibration& calibration) {
+    Published& published = GetPublished();
+    uint64_t version = published.version.load(std::memory_order_relaxed);
+    published.version.store(version + 1, std::memory_order_relaxed);
+    // Release, so that they are not written before the odd version.
+    published.ticks.store(calibration.ticks, std::memory_order_release);
+    published.wall_ns.store(calibration.wall_ns, std::memory_order_release);
+    published.ns_per_tick.store(calibration.ns_per_tick,
+                                std::memory_order_release);
+    published.version.store(version + 2, std::memory_order_release);
+  }
+};
+}  // namespace internal
+
+#endif /* CYCLE_CLOCK_H_ */
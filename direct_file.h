@@ -0,0 +1,399 @@
+#ifndef DIRECT_FILE_H_
+#define DIRECT_FILE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include "utils.h"
+
+namespace file {
+// An append-only file written around the page cache, so that writing logs
+// does not evict the page cache of the rest of the machine. It is opened
+// with O_DIRECT (FILE_FLAG_NO_BUFFERING on Windows, F_NOCACHE on macOS).
+// Where the file system refuses that, it is written normally and each chunk
+// is dropped from the cache with posix_fadvise(POSIX_FADV_DONTNEED) once
+// sync_file_range(2) has written it back (Linux only).
+//
+// Writes are collected in two aligned buffers: a full one is written by a
+// background thread while the other fills. Flush() writes the aligned part
+// of the current buffer directly and the unaligned tail through the page
+// cache, and keeps the tail to write again once its block is full; the tail
+// is at most one block, so at most one block per file stays cached.
+class DirectFile {
+ public:
+  // Direct writes must be aligned to the logical block size of the device,
+  // which no common device has larger than this.
+  static constexpr size_t kAlignment = 4096;
+
+  // `mode` is "w" to truncate or "a" to append to an existing file.
+  // `buffer_size` is rounded up to a multiple of kAlignment.
+  DirectFile(const std::string& filename, const std::string& mode,
+             size_t buffer_size = 1 << 20)
+      : buffer_size_((buffer_size + kAlignment - 1) / kAlignment *
+                     kAlignment) {
+    SPIEL_CHECK_TRUE(mode == "w" || mode == "a");
+    SPIEL_CHECK_GT(buffer_size_, 0u);
+    std::int64_t size = Open(filename, mode == "w");
+    for (Buffer& buffer : buffers_) {
+      buffer.data = AllocateAligned(buffer_size_);
+    }
+    // Start at the last block boundary, with the partial block read back.
+    Buffer& buffer = buffers_[active_];
+    buffer.offset = size / kAlignment * kAlignment;
+    buffer.size = static_cast<size_t>(size - buffer.offset);
+    if (buffer.size > 0) {
+      SPIEL_CHECK_TRUE(ReadTail(buffer.data, buffer.size, buffer.offset));
+    }
+    thread_ = std::thread(&DirectFile::Run, this);
+  }
+
+  DirectFile(const DirectFile&) = delete;
+  DirectFile& operator=(const DirectFile&) = delete;
+
+  ~DirectFile() {
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    for (Buffer& buffer : buffers_) {
+      FreeAligned(buffer.data);
+    }
+    Close();
+  }
+
+  bool Write(const std::string& str) { return Write(str.data(), str.size()); }
+  bool Write(const char* data, size_t size) {
+    while (size > 0) {
+      Buffer& buffer = buffers_[active_];
+      size_t count = buffer_size_ - buffer.size;
+      if (count > size) {
+        count = size;
+      }
+      std::memcpy(buffer.data + buffer.size, data, count);
+      buffer.size += count;
+      data += count;
+      size -= count;
+      if (buffer.size == buffer_size_) {
+        Submit();
+      }
+    }
+    return !failed_.load(std::memory_order_relaxed);
+  }
+
+  // Writes everything out, waiting for the background write. Returns false
+  // if any write since the last Flush() failed.
+  bool Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (pending_ != nullptr) {
+      done_cv_.wait(lock);
+    }
+    lock.unlock();
+    bool ok = !failed_.exchange(false);
+
+    Buffer& buffer = buffers_[active_];
+    size_t aligned = buffer.size / kAlignment * kAlignment;
+    size_t tail = buffer.size - aligned;
+    if (aligned > 0) {
+      ok = WriteAt(buffer.data, aligned, buffer.offset) && ok;
+    }
+    if (tail > 0) {
+      ok = WriteTail(buffer.data + aligned, tail, buffer.offset + aligned) &&
+           ok;
+      std::memmove(buffer.data, buffer.data + aligned, tail);
+    }
+    buffer.offset += aligned;
+    buffer.size = tail;
+    return ok;
+  }
+
+  // For a crash handler: writes the buffers out through the page cache,
+  // without waiting for the background thread, and returns the descriptor
+  // to append to with write(2), or -1. The buffer in flight is written
+  // again, in case the background write does not complete.
+  int FlushOnCrash() {
+#ifdef _WIN32
+    return -1;
+#else
+#ifdef O_DIRECT
+    if (direct_) {
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+    }
+#endif
+    Buffer* pending = pending_;
+    if (pending != nullptr) {
+      WriteAt(pending->data, pending->size, pending->offset);
+    }
+    Buffer& buffer = buffers_[active_];
+    WriteAt(buffer.data, buffer.size, buffer.offset);
+    buffer.offset += buffer.size;
+    buffer.size = 0;
+    lseek(fd_, buffer.offset, SEEK_SET);
+    return fd_;
+#endif
+  }
+
+  // Is the page cache bypassed, or are written chunks dropped from it?
+  bool direct() const { return direct_; }
+
+ private:
+  struct Buffer {
+    char* data = nullptr;
+    size_t size = 0;
+    std::int64_t offset = 0;  // Of data[0] in the file.
+  };
+
+  // Hands the full active buffer to the background thread, once it is done
+  // with the other one.
+  void Submit() {
+    Buffer& full = buffers_[active_];
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (pending_ != nullptr) {
+      done_cv_.wait(lock);
+    }
+    pending_ = &full;
+    active_ ^= 1;
+    buffers_[active_].offset = full.offset + full.size;
+    buffers_[active_].size = 0;
+    lock.unlock();
+    cv_.notify_one();
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      while (pending_ == nullptr && !stop_) {
+        cv_.wait(lock);
+      }
+      if (pending_ == nullptr) {
+        return;
+      }
+      Buffer* buffer = pending_;
+      lock.unlock();
+      bool ok = WriteAt(buffer->data, buffer->size, buffer->offset);
+      if (ok && !direct_) {
+        DropFromCache(buffer->offset, buffer->size);
+      }
+      if (!ok) {
+        failed_.store(true);
+      }
+      lock.lock();
+      pending_ = nullptr;
+      done_cv_.notify_all();
+    }
+  }
+
+  static char* AllocateAligned(size_t size) {
+#ifdef _WIN32
+    void* data = _aligned_malloc(size, kAlignment);
+    SPIEL_CHECK_TRUE(data != nullptr);
+#else
+    void* data = nullptr;
+    SPIEL_CHECK_EQ(posix_memalign(&data, kAlignment, size), 0);
+#endif
+    return static_cast<char*>(data);
+  }
+
+  static void FreeAligned(char* data) {
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    std::free(data);
+#endif
+  }
+
+#ifdef _WIN32
+  // Returns the size of the file.
+  std::int64_t Open(const std::string& filename, bool truncate) {
+    file_ = CreateFileA(filename.c_str(), GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                        truncate ? CREATE_ALWAYS : OPEN_ALWAYS,
+                        FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
+                        nullptr);
+    SPIEL_CHECK_TRUE(file_ != INVALID_HANDLE_VALUE);
+    direct_ = true;
+    // Unaligned tails need a second, buffered handle.
+    tail_file_ = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    SPIEL_CHECK_TRUE(tail_file_ != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER size;
+    SPIEL_CHECK_TRUE(GetFileSizeEx(tail_file_, &size));
+    return size.QuadPart;
+  }
+
+  void Close() {
+    CloseHandle(file_);
+    CloseHandle(tail_file_);
+  }
+
+  static bool WriteHandle(HANDLE handle, const char* data, size_t size,
+                          std::int64_t offset) {
+    while (size > 0) {
+      OVERLAPPED position = {};
+      position.Offset = static_cast<DWORD>(offset);
+      position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD count = size > (1u << 30) ? (1u << 30) : static_cast<DWORD>(size);
+      DWORD written = 0;
+      if (!WriteFile(handle, data, count, &written, &position)) {
+        return false;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+    }
+    return true;
+  }
+
+  bool WriteAt(const char* data, size_t size, std::int64_t offset) {
+    return WriteHandle(file_, data, size, offset);
+  }
+
+  bool WriteTail(const char* data, size_t size, std::int64_t offset) {
+    return WriteHandle(tail_file_, data, size, offset);
+  }
+
+  bool ReadTail(char* data, size_t size, std::int64_t offset) {
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset);
+    position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read = 0;
+    return ReadFile(tail_file_, data, static_cast<DWORD>(size), &read,
+                    &position) &&
+           read == size;
+  }
+
+  void DropFromCache(std::int64_t offset, size_t size) {}
+
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE tail_file_ = INVALID_HANDLE_VALUE;
+#else
+  // Returns the size of the file.
+  std::int64_t Open(const std::string& filename, bool truncate) {
+    int flags = O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0);
+#ifdef O_DIRECT
+    fd_ = open(filename.c_str(), flags | O_DIRECT, 0644);
+    direct_ = fd_ >= 0;
+#endif
+    if (fd_ < 0) {
+      fd_ = open(filename.c_str(), flags, 0644);
+    }
+    SPIEL_CHECK_TRUE(fd_ >= 0);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    direct_ = fcntl(fd_, F_NOCACHE, 1) == 0;
+#endif
+    struct stat info;
+    SPIEL_CHECK_TRUE(fstat(fd_, &info) == 0);
+    return info.st_size;
+  }
+
+  void Close() { close(fd_); }
+
+  bool WriteAt(const char* data, size_t size, std::int64_t offset) {
+    while (size > 0) {
+      ssize_t written = pwrite(fd_, data, size, offset);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+    }
+    return true;
+  }
+
+  // O_DIRECT is turned off for the length of the write. The background
+  // thread is idle whenever this is called.
+  bool WriteTail(const char* data, size_t size, std::int64_t offset) {
+#ifdef O_DIRECT
+    int flags = fcntl(fd_, F_GETFL);
+    if (direct_ && fcntl(fd_, F_SETFL, flags & ~O_DIRECT) != 0) {
+      return false;
+    }
+    bool ok = WriteAt(data, size, offset);
+    if (direct_ && fcntl(fd_, F_SETFL, flags) != 0) {
+      ok = false;
+    }
+    return ok;
+#else
+    return WriteAt(data, size, offset);
+#endif
+  }
+
+  bool ReadTail(char* data, size_t size, std::int64_t offset) {
+#ifdef O_DIRECT
+    int flags = fcntl(fd_, F_GETFL);
+    if (direct_) {
+      fcntl(fd_, F_SETFL, flags & ~O_DIRECT);
+    }
+#endif
+    bool ok = pread(fd_, data, size, offset) == static_cast<ssize_t>(size);
+#ifdef O_DIRECT
+    if (direct_) {
+      fcntl(fd_, F_SETFL, flags);
+    }
+#endif
+    return ok;
+  }
+
+  // Starts writing back this chunk, then waits for the previous one and
+  // drops it from the cache: pages still dirty would stay cached.
+  void DropFromCache(std::int64_t offset, size_t size) {
+#ifdef __linux__
+    sync_file_range(fd_, offset, size, SYNC_FILE_RANGE_WRITE);
+    if (previous_size_ > 0) {
+      sync_file_range(fd_, previous_offset_, previous_size_,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd_, previous_offset_, previous_size_,
+                    POSIX_FADV_DONTNEED);
+    }
+    previous_offset_ = offset;
+    previous_size_ = size;
+#endif
+  }
+
+  int fd_ = -1;
+  // The last chunk DropFromCache() has started writing back.
+  std::int64_t previous_offset_ = 0;
+  size_t previous_size_ = 0;
+#endif
+
+  size_t buffer_size_;
+  bool direct_ = false;
+  Buffer buffers_[2];
+  int active_ = 0;  // The buffer being filled.
+
+  std::mutex mutex_;
+  std::condition_variable cv_;       // Wakes up the background thread.
+  std::condition_variable done_cv_;  // Signals that pending_ was written.
+  Buffer* pending_ = nullptr;        // Being or to be written.
+  std::atomic<bool> failed_{false};  // Since the last Flush().
+  bool stop_ = false;
+  std::thread thread_;
+};
+}  // namespace file
+
+#endif /* DIRECT_FILE_H_ */
@@ -0,0 +1,248 @@
+#ifndef FIELDS_H_
+#define FIELDS_H_
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+#include "format.h"
+#include "line_buffer.h"
+#include "string_view.h"
+
+// A key and a reference to its value, made by kv() for the structured
+// Print(level, message, kv(...), ...). The value must outlive the call,
+// which temporaries in the argument list do.
+template <typename T>
+struct KeyValue {
+  StringView key;
+  const T& value;
+};
+
+template <typename T>
+KeyValue<T> kv(StringView key, const T& value) {
+  return KeyValue<T>{key, value};
+}
+
+// One key-value pair of a structured record, with the type of the value
+// erased so that loggers can take the fields through a virtual call.
+// Numbers, bools, characters and strings are stored as they are; any other
+// type is kept by address, with a function to format it.
+struct Field {
+  enum class Type : uint8_t {
+    kInt,
+    kUint,
+    kDouble,
+    kBool,
+    kChar,
+    kString,
+    kOther,
+  };
+
+  StringView key;
+  Type type;
+  union {
+    int64_t int_value;
+    uint64_t uint_value;
+    double double_value;
+    bool bool_value;
+    char char_value;
+    const void* other_value;
+  };
+  StringView string_value;
+  void (*append_other)(internal::LineBuffer& out, const void* value);
+
+  // Appends the value as Print("{}", value) would.
+  void AppendValue(internal::LineBuffer& out) const {
+    switch (type) {
+      case Type::kInt:
+        internal::AppendValue(out, int_value);
+        break;
+      case Type::kUint:
+        internal::AppendValue(out, uint_value);
+        break;
+      case Type::kDouble:
+        internal::AppendValue(out, double_value);
+        break;
+      case Type::kBool:
+        internal::AppendValue(out, bool_value);
+        break;
+      case Type::kChar:
+        out += char_value;
+        break;
+      case Type::kString:
+        out += string_value;
+        break;
+      case Type::kOther:
+        append_other(out, other_value);
+        break;
+    }
+  }
+};
+
+namespace internal {
+// FieldMaker<T>::Make(key, value) stores `value` in a Field, following the
+// same categories as Formatter<T>.
+template <typename T, typename Enable = void>
+struct FieldMaker {
+  static void AppendOther(LineBuffer& out, const void* value) {
+    Formatter<T>::Append(out, *static_cast<const T*>(value));
+  }
+
+  static Field Make(StringView key, const T& value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kOther;
+    field.other_value = &value;
+    field.append_other = &AppendOther;
+    return field;
+  }
+};
+
+template <typename T>
+struct FieldMaker<T,
+                  typename std::enable_if<std::is_integral<T>::value &&
+                                          std::is_signed<T>::value &&
+                                          !IsCharacter<T>::value>::type> {
+  static Field Make(StringView key, T value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kInt;
+    field.int_value = value;
+    return field;
+  }
+};
+
+template <typename T>
+struct FieldMaker<T,
+                  typename std::enable_if<std::is_integral<T>::value &&
+                                          std::is_unsigned<T>::value &&
+                                          !std::is_same<T, bool>::value &&
+                                          !IsCharacter<T>::value>::type> {
+  static Field Make(StringView key, T value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kUint;
+    field.uint_value = value;
+    return field;
+  }
+};
+
+template <typename T>
+struct FieldMaker<T, typename std::enable_if<IsCharacter<T>::value>::type> {
+  static Field Make(StringView key, T value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kChar;
+    field.char_value = static_cast<char>(value);
+    return field;
+  }
+};
+
+template <>
+struct FieldMaker<bool> {
+  static Field Make(StringView key, bool value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kBool;
+    field.bool_value = value;
+    return field;
+  }
+};
+
+template <typename T>
+struct FieldMaker<
+    T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static Field Make(StringView key, T value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kDouble;
+    field.double_value = value;
+    return field;
+  }
+};
+
+template <>
+struct FieldMaker<StringView> {
+  static Field Make(StringView key, StringView value) {
+    Field field;
+    field.key = key;
+    field.type = Field::Type::kString;
+    field.string_value = value;
+    return field;
+  }
+};
+
+template <>
+struct FieldMaker<std::string> : FieldMaker<StringView> {};
+
+template <>
+struct FieldMaker<const char*> {
+  static Field Make(StringView key, const char* value) {
+    return FieldMaker<StringView>::Make(key,
+                                        value == nullptr ? "(null)" : value);
+  }
+};
+
+template <>
+struct FieldMaker<char*> : FieldMaker<const char*> {};
+
+template <size_t N>
+struct FieldMaker<char[N]> : FieldMaker<const char*> {};
+
+template <typename T>
+Field MakeField(const KeyValue<T>& pair) {
+  return FieldMaker<T>::Make(pair.key, pair.value);
+}
+
+// Appends a logfmt value: as it is, or quoted if it is empty or holds
+// spaces, quotes, '=' or control characters.
+inline void AppendLogfmtValue(LineBuffer& out, StringView value) {
+  bool quote = value.empty();
+  for (char c : value) {
+    if (static_cast<unsigned char>(c) <= ' ' || c == '"' || c == '=') {
+      quote = true;
+      break;
+    }
+  }
+  if (!quote) {
+    out += value;
+    return;
+  }
+  out += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+// Appends "message key=value key=value", the text form of a structured
+// record.
+inline void AppendLogfmt(LineBuffer& out, StringView message,
+                         const Field* fields, size_t count) {
+  out += message;
+  for (size_t i = 0; i < count; ++i) {
+    out += ' ';
+    out += fields[i].key;
+    out += '=';
+    if (fields[i].type == Field::Type::kString) {
+      AppendLogfmtValue(out, fields[i].string_value);
+    } else if (fields[i].type == Field::Type::kChar ||
+               fields[i].type == Field::Type::kOther) {
+      ScopedLineBuffer value;
+      fields[i].AppendValue(value.get());
+      AppendLogfmtValue(out, value->view());
+    } else {
+      fields[i].AppendValue(out);
+    }
+  }
+}
+}  // namespace internal
+
+#endif /* FIELDS_H_ */
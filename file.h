@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <climits>
 #include <cstdlib>
 #include <memory>
 #include <string>
@@ -16,21 +17,83 @@
 #define unlink(file) _unlink(file)
 #define rmdir(dir) _rmdir(dir)
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+
+#include <cerrno>
 #endif
 
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <utility>
+#include "string_view.h"
 #include "utils.h"
 
 namespace file {
+// One piece of a vectored write.
+struct Slice {
+  const char* data;
+  size_t size;
+};
+
+struct FileOptions {
+  // Size of the stdio buffer, instead of the default BUFSIZ bytes. Writes
+  // reach the OS once this much has been buffered, or on Flush.
+  size_t buffer_size = 0;
+  // Reserve this many bytes of disk past the current end, so that the
+  // blocks are allocated at once instead of as the file grows. The file's
+  // size is left as it is. Linux only; elsewhere it is ignored.
+  std::int64_t preallocate = 0;
+  // For a file that only one thread at a time uses: write without taking
+  // the stdio lock. On POSIX systems a write-only file then keeps its own
+  // buffer of buffer_size bytes and writes it with write(2), bypassing
+  // stdio, so that FlushOnCrash() can write it out from a signal handler;
+  // on Windows it writes with _fwrite_nolock.
+  bool unlocked = false;
+};
+
 class File {
  public:
-  File(const std::string& filename, const std::string& mode) {
+  File(const std::string& filename, const std::string& mode,
+       const FileOptions& options = FileOptions())
+      : writable_(mode.find_first_of("wa+") != std::string::npos),
+        unlocked_(options.unlocked) {
     fd_.reset(
         static_cast<FileImpl*>(std::fopen(filename.c_str(), mode.c_str())));
     SPIEL_CHECK_TRUE(fd_);
+#ifndef _WIN32
+    direct_ = unlocked_ && writable_ &&
+              mode.find_first_of("r+") == std::string::npos;
+#endif
+    if (direct_) {
+      if (options.buffer_size > 0) {
+        buffer_size_ = options.buffer_size;
+      }
+      buffer_.reset(new char[buffer_size_]);
+    } else if (options.buffer_size > 0) {
+      buffer_.reset(new char[options.buffer_size]);
+      if (std::setvbuf(fd_.get(), buffer_.get(), _IOFBF,
+                       options.buffer_size) == 0) {
+        buffer_size_ = options.buffer_size;
+      } else {
+        buffer_.reset();
+      }
+    }
+#ifdef __linux__
+    if (options.preallocate > 0) {
+      int fd = fileno(fd_.get());
+      struct stat info;
+      if (fstat(fd, &info) == 0) {
+        // Best effort: not every file system supports it.
+        preallocated_ = fallocate(fd, FALLOC_FL_KEEP_SIZE, info.st_size,
+                                  options.preallocate) == 0;
+      }
+    }
+#endif
   }
 
   // File is move only.
@@ -47,7 +110,16 @@ class File {
     }
   }
   // Flush the buffer to disk.
-  bool Flush() { return !std::fflush(fd_.get()); }
+  bool Flush() {
+#ifndef _WIN32
+    if (direct_) {
+      bool ok = WriteAll(fileno(fd_.get()), buffer_.get(), pending_);
+      pending_ = 0;
+      return ok;
+    }
+#endif
+    return !std::fflush(fd_.get());
+  }
   // Offset of the current point in the file.
   std::int64_t Tell() { return std::ftell(fd_.get()); }
   // Move the current point.
@@ -58,10 +130,13 @@ class File {
   // Read count bytes.
   std::string Read(std::int64_t count) {
     std::string out(count, '\0');
-    int read = std::fread(&out[0], sizeof(char), count, fd_.get());
-    out.resize(read);
+    out.resize(Read(&out[0], count));
     return out;
   }
+  // Read up to `size` bytes into `data`, and return how many were read.
+  size_t Read(char* data, size_t size) {
+    return std::fread(data, sizeof(char), size, fd_.get());
+  }
 
   // Read the entire file.
   std::string ReadContents() {
@@ -70,28 +145,483 @@ class File {
   }
 
   // Write to the file.
-  bool Write(const std::string& str) {
-    return std::fwrite(str.data(), sizeof(char), str.size(), fd_.get()) ==
-           str.size();
+  bool Write(StringView str) { return Write(str.data(), str.size()); }
+  bool Write(const char* data, size_t size) {
+#ifdef _WIN32
+    if (unlocked_) {
+      return _fwrite_nolock(data, sizeof(char), size, fd_.get()) == size;
+    }
+#else
+    if (direct_) {
+      if (size > buffer_size_ - pending_) {
+        if (!Flush()) {
+          return false;
+        }
+        if (size >= buffer_size_) {
+          return WriteAll(fileno(fd_.get()), data, size);
+        }
+      }
+      std::memcpy(buffer_.get() + pending_, data, size);
+      pending_ += size;
+      return true;
+    }
+#endif
+    return std::fwrite(data, sizeof(char), size, fd_.get()) == size;
   }
 
-  // Length of the entire file.
+  // Write `count` slices in order. Writes smaller than the stdio buffer go
+  // through it like Write; larger ones flush it and go to the OS with
+  // writev(2), without copying the slices into the buffer first.
+  bool WriteV(const Slice* slices, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      total += slices[i].size;
+    }
+#ifndef _WIN32
+    if (total >= buffer_size_) {
+      return Flush() && WriteVUnbuffered(fileno(fd_.get()), slices, count);
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+      if (!Write(slices[i].data, slices[i].size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // For a crash handler: writes out the buffer of an `unlocked` file with
+  // write(2) and returns the descriptor to append to, or -1. The caller
+  // must know that no write is in progress. What a stdio buffer holds
+  // cannot be written out safely from a signal handler, so it is lost;
+  // FlushOnCrash() only returns the descriptor then.
+  int FlushOnCrash() {
+#ifdef _WIN32
+    return -1;
+#else
+    int fd = fileno(fd_.get());
+    if (direct_) {
+      WriteAll(fd, buffer_.get(), pending_);
+      pending_ = 0;
+    }
+    return fd;
+#endif
+  }
+
+  // Length of the entire file, including what is still buffered.
   std::int64_t Length() {
-    std::int64_t current = std::ftell(fd_.get());
-    std::fseek(fd_.get(), 0, SEEK_END);
-    std::int64_t length = std::ftell(fd_.get());
-    std::fseek(fd_.get(), current, SEEK_SET);
-    return length;
+    if (writable_) {
+      Flush();
+    }
+#ifdef _WIN32
+    struct _stat64 info;
+    return _fstat64(_fileno(fd_.get()), &info) == 0 ? info.st_size : -1;
+#else
+    struct stat info;
+    return fstat(fileno(fd_.get()), &info) == 0 ? info.st_size : -1;
+#endif
   }
 
  private:
   // Close the file. Use the destructor instead.
-  bool Close() { return !std::fclose(fd_.release()); }
+  bool Close() {
+#ifdef __linux__
+    if (preallocated_ && Flush()) {
+      // Give back the reserved blocks the file did not grow into.
+      int fd = fileno(fd_.get());
+      struct stat info;
+      if (fstat(fd, &info) == 0 && ftruncate(fd, info.st_size) != 0) {
+        // The blocks stay reserved; the data is fine.
+      }
+    }
+#endif
+    return !std::fclose(fd_.release());
+  }
+
+#ifndef _WIN32
+  // Retries partial and interrupted writes. Async-signal-safe.
+  static bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t written = ::write(fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  // Retries partial writes, and splits the slices into writev calls of at
+  // most kMaxIov pieces.
+  static bool WriteVUnbuffered(int fd, const Slice* slices, size_t count) {
+    constexpr int kMaxIov = 256;
+    struct iovec iov[kMaxIov];
+    size_t done = 0;  // Bytes of slices[0] already written.
+    while (count > 0) {
+      int n = 0;
+      for (size_t i = 0; i < count && n < kMaxIov; ++i, ++n) {
+        size_t skip = i == 0 ? done : 0;
+        iov[n].iov_base = const_cast<char*>(slices[i].data) + skip;
+        iov[n].iov_len = slices[i].size - skip;
+      }
+      ssize_t written = ::writev(fd, iov, n);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      size_t left = written;
+      while (count > 0 && left >= slices[0].size - done) {
+        left -= slices[0].size - done;
+        done = 0;
+        ++slices;
+        --count;
+      }
+      done += left;
+    }
+    return true;
+  }
+#endif
 
   class FileImpl : public std::FILE {};
+  // The buffer set with setvbuf, if any, which must outlive fd_, or the
+  // one `direct_` writes go through.
+  std::unique_ptr<char[]> buffer_;
+  size_t buffer_size_ = BUFSIZ;
+  size_t pending_ = 0;  // Bytes of buffer_ not written yet, if `direct_`.
+  bool writable_ = false;
+  bool unlocked_ = false;
+  bool direct_ = false;  // Writes bypass stdio.
+  bool preallocated_ = false;
   std::unique_ptr<FileImpl> fd_;
 };
 
+// An append-only file written through a memory mapping instead of stdio.
+// The file grows `chunk_size` bytes at a time and only the chunk being
+// written is mapped, so a record is a memcpy into the page cache with no
+// stdio lock or second buffer. Closing truncates the file to the bytes
+// actually written; a process that dies without closing leaves zeros after
+// the data.
+class MappedFile {
+ public:
+  // `mode` is "w" to truncate or "a" to append to an existing file.
+  MappedFile(const std::string& filename, const std::string& mode,
+             size_t chunk_size = 64 << 20) {
+    SPIEL_CHECK_TRUE(mode == "w" || mode == "a");
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t granularity = info.dwAllocationGranularity;
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ, nullptr,
+                        mode == "w" ? CREATE_ALWAYS : OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    SPIEL_CHECK_TRUE(file_ != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER size;
+    SPIEL_CHECK_TRUE(GetFileSizeEx(file_, &size));
+    size_ = size.QuadPart;
+#else
+    size_t granularity = sysconf(_SC_PAGESIZE);
+    fd_ = open(filename.c_str(),
+               O_RDWR | O_CREAT | (mode == "w" ? O_TRUNC : 0), 0644);
+    SPIEL_CHECK_TRUE(fd_ >= 0);
+    struct stat info;
+    SPIEL_CHECK_TRUE(fstat(fd_, &info) == 0);
+    size_ = info.st_size;
+#endif
+    chunk_size_ = (chunk_size + granularity - 1) / granularity * granularity;
+    SPIEL_CHECK_TRUE(MapChunk(size_ / chunk_size_ * chunk_size_));
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() { Close(); }
+
+  bool Write(const std::string& str) { return Write(str.data(), str.size()); }
+  bool Write(const char* data, size_t size) {
+    while (size > 0) {
+      std::int64_t map_end = map_offset_ + chunk_size_;
+      if (size_ == map_end && !MapChunk(map_end)) {
+        return false;
+      }
+      size_t offset = size_ - map_offset_;
+      size_t count = chunk_size_ - offset;
+      if (count > size) {
+        count = size;
+      }
+      std::memcpy(map_ + offset, data, count);
+      size_ += count;
+      data += count;
+      size -= count;
+    }
+    return true;
+  }
+
+  // Asks the OS to start writing the mapped pages back.
+  bool Flush() {
+    size_t used = size_ - map_offset_;
+#ifdef _WIN32
+    return used == 0 || FlushViewOfFile(map_, used);
+#else
+    return used == 0 || msync(map_, used, MS_ASYNC) == 0;
+#endif
+  }
+
+  // Bytes written, which is what the file is truncated to on close.
+  std::int64_t Length() const { return size_; }
+
+ private:
+  // Extends the file to cover the chunk at `offset` and maps it.
+  bool MapChunk(std::int64_t offset) {
+    Unmap();
+    std::int64_t end = offset + chunk_size_;
+#ifdef _WIN32
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE,
+                                  static_cast<DWORD>(end >> 32),
+                                  static_cast<DWORD>(end), nullptr);
+    if (mapping_ == nullptr) {
+      return false;
+    }
+    void* map = MapViewOfFile(mapping_, FILE_MAP_WRITE,
+                              static_cast<DWORD>(offset >> 32),
+                              static_cast<DWORD>(offset), chunk_size_);
+    if (map == nullptr) {
+      return false;
+    }
+#else
+#ifdef __linux__
+    // Reserve the blocks now, so a full disk fails here instead of with a
+    // SIGBUS on a later memcpy. Only where the file cannot be allocated at
+    // all is it extended sparse; any other error, ENOSPC included, fails.
+    int error = posix_fallocate(fd_, offset, chunk_size_);
+    bool unsupported = error == EINVAL || error == EOPNOTSUPP;
+    if (error != 0 && (!unsupported || ftruncate(fd_, end) != 0)) {
+      return false;
+    }
+#else
+    if (ftruncate(fd_, end) != 0) {
+      return false;
+    }
+#endif
+    void* map = mmap(nullptr, chunk_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd_, offset);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+#endif
+    map_ = static_cast<char*>(map);
+    map_offset_ = offset;
+    return true;
+  }
+
+  void Unmap() {
+    if (map_ == nullptr) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(map_);
+    CloseHandle(mapping_);
+    mapping_ = nullptr;
+#else
+    munmap(map_, chunk_size_);
+#endif
+    map_ = nullptr;
+  }
+
+  // Unmap and truncate to the written length.
+  void Close() {
+    Unmap();
+#ifdef _WIN32
+    if (file_ != INVALID_HANDLE_VALUE) {
+      LARGE_INTEGER size;
+      size.QuadPart = size_;
+      SetFilePointerEx(file_, size, nullptr, FILE_BEGIN);
+      SetEndOfFile(file_);
+      CloseHandle(file_);
+      file_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (fd_ >= 0) {
+      if (ftruncate(fd_, size_) != 0) {
+        // Keep the padding rather than lose the data; readers stop at the
+        // first zero byte.
+      }
+      close(fd_);
+      fd_ = -1;
+    }
+#endif
+  }
+
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+  size_t chunk_size_ = 0;
+  std::int64_t size_ = 0;
+  std::int64_t map_offset_ = 0;
+  char* map_ = nullptr;
+};
+
+// The whole of a file, mapped read-only: data() points into the page cache,
+// so reading a large log costs no copy and no buffer of its size. Pages are
+// read in as they are touched. The file must not shrink while it is mapped;
+// what is appended to it afterwards is not seen.
+class MappedView {
+ public:
+  // Dies if the file cannot be opened or mapped.
+  explicit MappedView(const std::string& filename) {
+#ifdef _WIN32
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    SPIEL_CHECK_TRUE(file_ != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER size;
+    SPIEL_CHECK_TRUE(GetFileSizeEx(file_, &size));
+    size_ = static_cast<size_t>(size.QuadPart);
+    if (size_ == 0) {
+      return;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0,
+                                  nullptr);
+    SPIEL_CHECK_TRUE(mapping_ != nullptr);
+    data_ = static_cast<const char*>(
+        MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    SPIEL_CHECK_TRUE(data_ != nullptr);
+#else
+    fd_ = open(filename.c_str(), O_RDONLY);
+    SPIEL_CHECK_TRUE(fd_ >= 0);
+    struct stat info;
+    SPIEL_CHECK_TRUE(fstat(fd_, &info) == 0);
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_ == 0) {
+      return;  // mmap refuses empty mappings.
+    }
+    void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    SPIEL_CHECK_TRUE(map != MAP_FAILED);
+    // Logs are read front to back: read ahead, and drop pages behind.
+    madvise(map, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(map);
+#endif
+  }
+
+  MappedView(const MappedView&) = delete;
+  MappedView& operator=(const MappedView&) = delete;
+
+  ~MappedView() {
+#ifdef _WIN32
+    if (data_ != nullptr) {
+      UnmapViewOfFile(data_);
+    }
+    if (mapping_ != nullptr) {
+      CloseHandle(mapping_);
+    }
+    CloseHandle(file_);
+#else
+    if (data_ != nullptr) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+    close(fd_);
+#endif
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  StringView view() const { return StringView(data_, size_); }
+
+ private:
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Reads a file line by line through a buffer of `chunk_size` bytes, so it
+// takes little memory however big the file is:
+//
+//   file::LineReader reader("log-server.txt");
+//   StringView line;
+//   while (reader.Next(&line)) { ... }
+//
+// Lines longer than the buffer grow it. Newlines are found with memchr,
+// which the C library vectorizes.
+class LineReader {
+ public:
+  // Dies if the file cannot be opened.
+  explicit LineReader(const std::string& filename,
+                      size_t chunk_size = 1 << 20)
+      : file_(filename, "rb"),
+        capacity_(chunk_size > 0 ? chunk_size : 1),
+        buffer_(new char[capacity_]) {}
+
+  // Sets `line` to the next line, without its '\n', valid until the next
+  // call. A last line without a newline is returned as well. Returns false
+  // at the end of the file.
+  bool Next(StringView* line) {
+    while (true) {
+      const void* newline =
+          std::memchr(buffer_.get() + scanned_, '\n', end_ - scanned_);
+      if (newline != nullptr) {
+        const char* stop = static_cast<const char*>(newline);
+        *line = StringView(buffer_.get() + begin_,
+                           stop - (buffer_.get() + begin_));
+        begin_ = scanned_ = stop - buffer_.get() + 1;
+        return true;
+      }
+      scanned_ = end_;
+      if (eof_ || !Fill()) {
+        if (begin_ == end_) {
+          return false;
+        }
+        *line = StringView(buffer_.get() + begin_, end_ - begin_);
+        begin_ = scanned_ = end_;
+        return true;
+      }
+    }
+  }
+
+ private:
+  // Moves the partial line to the front of the buffer, growing it if the
+  // line fills it, and reads more after it. Returns false at the end of
+  // the file.
+  bool Fill() {
+    size_t pending = end_ - begin_;
+    if (pending == capacity_) {
+      std::unique_ptr<char[]> bigger(new char[capacity_ * 2]);
+      std::memcpy(bigger.get(), buffer_.get() + begin_, pending);
+      buffer_ = std::move(bigger);
+      capacity_ *= 2;
+    } else if (begin_ > 0) {
+      std::memmove(buffer_.get(), buffer_.get() + begin_, pending);
+    }
+    begin_ = 0;
+    scanned_ = end_ = pending;
+    size_t read = file_.Read(buffer_.get() + end_, capacity_ - end_);
+    end_ += read;
+    eof_ = read == 0;
+    return !eof_;
+  }
+
+  File file_;
+  size_t capacity_;
+  std::unique_ptr<char[]> buffer_;
+  size_t begin_ = 0;    // Start of the next line.
+  size_t scanned_ = 0;  // No newline in [begin_, scanned_).
+  size_t end_ = 0;
+  bool eof_ = false;
+};
+
 // Reads the file at filename to a string. Dies if this doesn't succeed.
 std::string ReadContentsFromFile(const std::string& filename,
                                  const std::string& mode) {
@@ -147,6 +677,20 @@ bool Remove(const std::string& path) {
     return unlink(path.c_str()) == 0;
   }
 }
+// Rename a file, replacing any existing file at `to`.
+bool Rename(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+  if (Exists(to)) {
+    Remove(to);
+  }
+#endif
+  return std::rename(from.c_str(), to.c_str()) == 0;
+}
+// Size of the file in bytes, or -1 if it doesn't exist.
+std::int64_t Size(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
 
 // Get the canonical file path.
 std::string RealPath(const std::string& path) {
@@ -0,0 +1,289 @@
+#ifndef FLOAT_FORMAT_H_
+#define FLOAT_FORMAT_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+// Shortest decimal digits for a float or double that parse back to it,
+// with Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly
+// and Accurately with Integers", PLDI 2010): a handful of 64-bit
+// multiplications instead of snprintf, and no locale. The digits always
+// round-trip; in rare cases Grisu2 gives one more digit than the shortest
+// possible.
+
+namespace internal {
+namespace grisu {
+// A floating-point value f * 2^e with a 64-bit significand.
+struct DiyFp {
+  uint64_t f;
+  int e;
+
+  DiyFp(uint64_t f, int e) : f(f), e(e) {}
+
+  // Requires x.e == y.e and x.f >= y.f.
+  static DiyFp Sub(DiyFp x, DiyFp y) { return DiyFp(x.f - y.f, x.e); }
+
+  // The upper 64 bits of the 128-bit product, rounded.
+  static DiyFp Mul(DiyFp x, DiyFp y) {
+    const uint64_t x_lo = x.f & 0xFFFFFFFFu;
+    const uint64_t x_hi = x.f >> 32;
+    const uint64_t y_lo = y.f & 0xFFFFFFFFu;
+    const uint64_t y_hi = y.f >> 32;
+    const uint64_t p0 = x_lo * y_lo;
+    const uint64_t p1 = x_lo * y_hi;
+    const uint64_t p2 = x_hi * y_lo;
+    const uint64_t p3 = x_hi * y_hi;
+    uint64_t middle = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    middle += uint64_t{1} << 31;
+    return DiyFp(p3 + (p1 >> 32) + (p2 >> 32) + (middle >> 32),
+                 x.e + y.e + 64);
+  }
+
+  static DiyFp Normalize(DiyFp x) {
+    while ((x.f >> 63) == 0) {
+      x.f <<= 1;
+      --x.e;
+    }
+    return x;
+  }
+
+  // Shifts `x` to exponent `e`, which is not above x.e.
+  static DiyFp NormalizeTo(DiyFp x, int e) {
+    return DiyFp(x.f << (x.e - e), e);
+  }
+};
+
+// The value, normalized, and the boundaries halfway to its neighbours,
+// all with the exponent of the upper one.
+struct Boundaries {
+  DiyFp w;
+  DiyFp minus;
+  DiyFp plus;
+};
+
+// `value` is finite and positive.
+template <typename T>
+Boundaries ComputeBoundaries(T value) {
+  typedef typename std::conditional<sizeof(T) == 8, uint64_t, uint32_t>::type
+      Bits;
+  const int kPrecision = std::numeric_limits<T>::digits;  // With hidden bit.
+  const int kBias = std::numeric_limits<T>::max_exponent - 1 + kPrecision - 1;
+  const int kMinExponent = 1 - kBias;
+  const uint64_t kHiddenBit = uint64_t{1} << (kPrecision - 1);
+
+  Bits bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint64_t exponent = bits >> (kPrecision - 1);
+  const uint64_t fraction = bits & (kHiddenBit - 1);
+  const DiyFp v = exponent == 0
+                      ? DiyFp(fraction, kMinExponent)
+                      : DiyFp(fraction + kHiddenBit,
+                              static_cast<int>(exponent) - kBias);
+  // The lower neighbour is closer at a power of two, but for the smallest
+  // normal value.
+  const bool lower_is_closer = fraction == 0 && exponent > 1;
+  const DiyFp plus = DiyFp(2 * v.f + 1, v.e - 1);
+  const DiyFp minus = lower_is_closer ? DiyFp(4 * v.f - 1, v.e - 2)
+                                      : DiyFp(2 * v.f - 1, v.e - 1);
+  const DiyFp normalized_plus = DiyFp::Normalize(plus);
+  return Boundaries{DiyFp::Normalize(v),
+                    DiyFp::NormalizeTo(minus, normalized_plus.e),
+                    normalized_plus};
+}
+
+// Scaled by a cached power of ten, the upper boundary gets a binary
+// exponent in [kAlpha, kGamma], so that the digits before the point fit
+// in 32 bits.
+constexpr int kAlpha = -60;
+constexpr int kGamma = -32;
+
+struct CachedPower {
+  uint64_t f;
+  int e;
+  int k;  // f * 2^e is about 10^k.
+};
+
+// c * 2^e approximately 10^k with alpha <= c.e + e + 64 <= gamma.
+inline CachedPower CachedPowerFor(int e) {
+  // 10^k for k from -300 to 324 in steps of 8, rounded to 64 bits.
+  static const CachedPower kCachedPowers[] = {
+    {0xAB70FE17C79AC6CAull, -1060, -300},
+    {0xFF77B1FCBEBCDC4Full, -1034, -292},
+    {0xBE5691EF416BD60Cull, -1007, -284},
+    {0x8DD01FAD907FFC3Cull, -980, -276},
+    {0xD3515C2831559A83ull, -954, -268},
+    {0x9D71AC8FADA6C9B5ull, -927, -260},
+    {0xEA9C227723EE8BCBull, -901, -252},
+    {0xAECC49914078536Dull, -874, -244},
+    {0x823C12795DB6CE57ull, -847, -236},
+    {0xC21094364DFB5637ull, -821, -228},
+    {0x9096EA6F3848984Full, -794, -220},
+    {0xD77485CB25823AC7ull, -768, -212},
+    {0xA086CFCD97BF97F4ull, -741, -204},
+    {0xEF340A98172AACE5ull, -715, -196},
+    {0xB23867FB2A35B28Eull, -688, -188},
+    {0x84C8D4DFD2C63F3Bull, -661, -180},
+    {0xC5DD44271AD3CDBAull, -635, -172},
+    {0x936B9FCEBB25C996ull, -608, -164},
+    {0xDBAC6C247D62A584ull, -582, -156},
+    {0xA3AB66580D5FDAF6ull, -555, -148},
+    {0xF3E2F893DEC3F126ull, -529, -140},
+    {0xB5B5ADA8AAFF80B8ull, -502, -132},
+    {0x87625F056C7C4A8Bull, -475, -124},
+    {0xC9BCFF6034C13053ull, -449, -116},
+    {0x964E858C91BA2655ull, -422, -108},
+    {0xDFF9772470297EBDull, -396, -100},
+    {0xA6DFBD9FB8E5B88Full, -369, -92},
+    {0xF8A95FCF88747D94ull, -343, -84},
+    {0xB94470938FA89BCFull, -316, -76},
+    {0x8A08F0F8BF0F156Bull, -289, -68},
+    {0xCDB02555653131B6ull, -263, -60},
+    {0x993FE2C6D07B7FACull, -236, -52},
+    {0xE45C10C42A2B3B06ull, -210, -44},
+    {0xAA242499697392D3ull, -183, -36},
+    {0xFD87B5F28300CA0Eull, -157, -28},
+    {0xBCE5086492111AEBull, -130, -20},
+    {0x8CBCCC096F5088CCull, -103, -12},
+    {0xD1B71758E219652Cull, -77, -4},
+    {0x9C40000000000000ull, -50, 4},
+    {0xE8D4A51000000000ull, -24, 12},
+    {0xAD78EBC5AC620000ull, 3, 20},
+    {0x813F3978F8940984ull, 30, 28},
+    {0xC097CE7BC90715B3ull, 56, 36},
+    {0x8F7E32CE7BEA5C70ull, 83, 44},
+    {0xD5D238A4ABE98068ull, 109, 52},
+    {0x9F4F2726179A2245ull, 136, 60},
+    {0xED63A231D4C4FB27ull, 162, 68},
+    {0xB0DE65388CC8ADA8ull, 189, 76},
+    {0x83C7088E1AAB65DBull, 216, 84},
+    {0xC45D1DF942711D9Aull, 242, 92},
+    {0x924D692CA61BE758ull, 269, 100},
+    {0xDA01EE641A708DEAull, 295, 108},
+    {0xA26DA3999AEF774Aull, 322, 116},
+    {0xF209787BB47D6B85ull, 348, 124},
+    {0xB454E4A179DD1877ull, 375, 132},
+    {0x865B86925B9BC5C2ull, 402, 140},
+    {0xC83553C5C8965D3Dull, 428, 148},
+    {0x952AB45CFA97A0B3ull, 455, 156},
+    {0xDE469FBD99A05FE3ull, 481, 164},
+    {0xA59BC234DB398C25ull, 508, 172},
+    {0xF6C69A72A3989F5Cull, 534, 180},
+    {0xB7DCBF5354E9BECEull, 561, 188},
+    {0x88FCF317F22241E2ull, 588, 196},
+    {0xCC20CE9BD35C78A5ull, 614, 204},
+    {0x98165AF37B2153DFull, 641, 212},
+    {0xE2A0B5DC971F303Aull, 667, 220},
+    {0xA8D9D1535CE3B396ull, 694, 228},
+    {0xFB9B7CD9A4A7443Cull, 720, 236},
+    {0xBB764C4CA7A44410ull, 747, 244},
+    {0x8BAB8EEFB6409C1Aull, 774, 252},
+    {0xD01FEF10A657842Cull, 800, 260},
+    {0x9B10A4E5E9913129ull, 827, 268},
+    {0xE7109BFBA19C0C9Dull, 853, 276},
+    {0xAC2820D9623BF429ull, 880, 284},
+    {0x80444B5E7AA7CF85ull, 907, 292},
+    {0xBF21E44003ACDD2Dull, 933, 300},
+    {0x8E679C2F5E44FF8Full, 960, 308},
+    {0xD433179D9C8CB841ull, 986, 316},
+    {0x9E19DB92B4E31BA9ull, 1013, 324},
+  };
+  const int kMinDecimalExponent = -300;
+  const int kDecimalStep = 8;
+  // k = ceil((alpha - e - 1) * log10(2)), with 78913 / 2^18 for log10(2).
+  const int f = kAlpha - e - 1;
+  const int k = (f * 78913) / (1 << 18) + static_cast<int>(f > 0);
+  const int index =
+      (-kMinDecimalExponent + k + (kDecimalStep - 1)) / kDecimalStep;
+  return kCachedPowers[index];
+}
+
+// The number of decimal digits of `n`, with `pow10` set to 10^(digits-1).
+inline int LargestPow10(uint32_t n, uint32_t* pow10) {
+  int digits = 1;
+  *pow10 = 1;
+  while (digits < 10 && n / *pow10 >= 10) {
+    *pow10 *= 10;
+    ++digits;
+  }
+  return digits;
+}
+
+// Moves the last digit towards `dist`, the scaled value, while that stays
+// within the boundaries.
+inline void Round(char* digits, int length, uint64_t dist, uint64_t delta,
+                  uint64_t rest, uint64_t ten_k) {
+  while (rest < dist && delta - rest >= ten_k &&
+         (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    --digits[length - 1];
+    rest += ten_k;
+  }
+}
+
+// Generates the digits of a number in (minus, plus), as close to `w` as
+// they can get, into `digits`.
+inline void GenerateDigits(char* digits, int* length, int* exponent,
+                           DiyFp minus, DiyFp w, DiyFp plus) {
+  uint64_t delta = DiyFp::Sub(plus, minus).f;
+  uint64_t dist = DiyFp::Sub(plus, w).f;
+  const int shift = -plus.e;
+  const uint64_t one = uint64_t{1} << shift;
+  uint32_t integral = static_cast<uint32_t>(plus.f >> shift);
+  uint64_t fractional = plus.f & (one - 1);
+
+  uint32_t pow10;
+  int n = LargestPow10(integral, &pow10);
+  while (n > 0) {
+    digits[(*length)++] = static_cast<char>('0' + integral / pow10);
+    integral %= pow10;
+    --n;
+    const uint64_t rest = (uint64_t{integral} << shift) + fractional;
+    if (rest <= delta) {
+      *exponent += n;
+      Round(digits, *length, dist, delta, rest, uint64_t{pow10} << shift);
+      return;
+    }
+    pow10 /= 10;
+  }
+  int m = 0;
+  while (true) {
+    fractional *= 10;
+    digits[(*length)++] = static_cast<char>('0' + (fractional >> shift));
+    fractional &= one - 1;
+    ++m;
+    delta *= 10;
+    dist *= 10;
+    if (fractional <= delta) {
+      break;
+    }
+  }
+  *exponent -= m;
+  Round(digits, *length, dist, delta, fractional, one);
+}
+}  // namespace grisu
+
+// Sets `digits` to at most 17 decimal digits, and `exponent` so that
+// digits * 10^exponent is `value`, which is finite and positive. Returns
+// the number of digits.
+template <typename T>
+int ShortestDigits(T value, char* digits, int* exponent) {
+  using grisu::DiyFp;
+  const grisu::Boundaries boundaries = grisu::ComputeBoundaries(value);
+  const grisu::CachedPower cached = grisu::CachedPowerFor(boundaries.plus.e);
+  const DiyFp power(cached.f, cached.e);
+  const DiyFp w = DiyFp::Mul(boundaries.w, power);
+  const DiyFp minus = DiyFp::Mul(boundaries.minus, power);
+  const DiyFp plus = DiyFp::Mul(boundaries.plus, power);
+  // One unit in, for the error of the multiplications.
+  int length = 0;
+  *exponent = -cached.k;
+  grisu::GenerateDigits(digits, &length, exponent,
+                        DiyFp(minus.f + 1, minus.e), w,
+                        DiyFp(plus.f - 1, plus.e));
+  return length;
+}
+}  // namespace internal
+
+#endif /* FLOAT_FORMAT_H_ */
@@ -0,0 +1,395 @@
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "float_format.h"
+#include "line_buffer.h"
+#include "string_view.h"
+
+namespace internal {
+// Writes the decimal digits of `value` backwards, ending just before `end`,
+// two digits per step from a lookup table. Returns the first digit.
+inline char* FormatUnsigned(uint64_t value, char* end) {
+  static const char kDigitPairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233"
+      "34353637383940414243444546474849505152535455565758596061626364656667"
+      "6869707172737475767778798081828384858687888990919293949596979899";
+  while (value >= 100) {
+    const char* pair = kDigitPairs + (value % 100) * 2;
+    value /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (value >= 10) {
+    const char* pair = kDigitPairs + value * 2;
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = static_cast<char>('0' + value);
+  }
+  return end;
+}
+
+// Appends the shortest digits that parse back to `value`, laid out as
+// "%.{p}g" would, with p at least `min_digits`: 0.1, 1e+20, 1.5e-07. The
+// point is always '.', whatever the locale. Non-finite values print as
+// "inf", "-inf" and "nan".
+template <typename T>
+void AppendFloat(LineBuffer& out, T value, int min_digits) {
+  if (std::isnan(value)) {
+    out += "nan";
+    return;
+  }
+  if (std::signbit(value)) {
+    out += '-';
+    value = -value;
+  }
+  if (std::isinf(value)) {
+    out += "inf";
+    return;
+  }
+  if (value == 0) {
+    out += '0';
+    return;
+  }
+  char digits[24];
+  int exponent;
+  int length = ShortestDigits(value, digits, &exponent);
+  // Where the point goes after the digits, and the exponent %e would print.
+  int point = length + exponent;
+  int scientific = point - 1;
+  char text[32];
+  char* pos = text;
+  if (scientific < -4 || scientific >= std::max(min_digits, length)) {
+    *pos++ = digits[0];
+    if (length > 1) {
+      *pos++ = '.';
+      pos = std::copy(digits + 1, digits + length, pos);
+    }
+    *pos++ = 'e';
+    *pos++ = scientific < 0 ? '-' : '+';
+    int magnitude = scientific < 0 ? -scientific : scientific;
+    if (magnitude < 10) {
+      *pos++ = '0';
+    }
+    char number[8];
+    char* number_end = number + sizeof(number);
+    pos = std::copy(FormatUnsigned(magnitude, number_end), number_end, pos);
+  } else if (point <= 0) {
+    *pos++ = '0';
+    *pos++ = '.';
+    pos = std::fill_n(pos, -point, '0');
+    pos = std::copy(digits, digits + length, pos);
+  } else if (point >= length) {
+    pos = std::copy(digits, digits + length, pos);
+    pos = std::fill_n(pos, point - length, '0');
+  } else {
+    pos = std::copy(digits, digits + point, pos);
+    *pos++ = '.';
+    pos = std::copy(digits + point, digits + length, pos);
+  }
+  out.append(text, pos - text);
+}
+
+// Formatter<T>::Append(out, value) appends `value` to `out`. The common
+// types are written directly into the string; anything else goes through
+// its stream operator<<.
+template <typename T, typename Enable = void>
+struct Formatter {
+  static void Append(LineBuffer& out, const T& value) {
+    std::ostringstream oss;
+    oss << value;
+    out += oss.str();
+  }
+};
+
+// Character types print as characters, as they do with operator<<.
+template <typename T>
+struct IsCharacter
+    : std::integral_constant<bool, std::is_same<T, char>::value ||
+                                       std::is_same<T, signed char>::value ||
+                                       std::is_same<T, unsigned char>::value> {
+};
+
+template <typename T>
+struct Formatter<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value &&
+                               !IsCharacter<T>::value>::type> {
+  static void Append(LineBuffer& out, T value) {
+    char buffer[24];
+    char* end = buffer + sizeof(buffer);
+    char* begin;
+    if (value < 0) {
+      // Negate as unsigned so the minimum value does not overflow.
+      begin = FormatUnsigned(0 - static_cast<uint64_t>(value), end);
+      *--begin = '-';
+    } else {
+      begin = FormatUnsigned(static_cast<uint64_t>(value), end);
+    }
+    out.append(begin, end - begin);
+  }
+};
+
+template <typename T>
+struct Formatter<T, typename std::enable_if<IsCharacter<T>::value>::type> {
+  static void Append(LineBuffer& out, T value) {
+    out += static_cast<char>(value);
+  }
+};
+
+// Matches operator<<, which prints bools as 1 and 0.
+template <>
+struct Formatter<bool> {
+  static void Append(LineBuffer& out, bool value) {
+    out += value ? '1' : '0';
+  }
+};
+
+template <>
+struct Formatter<double> {
+  static void Append(LineBuffer& out, double value) {
+    AppendFloat(out, value, 15);
+  }
+};
+
+template <>
+struct Formatter<float> {
+  static void Append(LineBuffer& out, float value) {
+    AppendFloat(out, value, 6);
+  }
+};
+
+template <>
+struct Formatter<StringView> {
+  static void Append(LineBuffer& out, StringView value) {
+    out.append(value.data(), value.size());
+  }
+};
+
+template <>
+struct Formatter<std::string> {
+  static void Append(LineBuffer& out, const std::string& value) {
+    out += value;
+  }
+};
+
+template <>
+struct Formatter<const char*> {
+  static void Append(LineBuffer& out, const char* value) {
+    if (value == nullptr) {
+      out += "(null)";
+    } else {
+      out += value;
+    }
+  }
+};
+
+template <>
+struct Formatter<char*> : Formatter<const char*> {};
+
+template <size_t N>
+struct Formatter<char[N]> : Formatter<const char*> {};
+
+// Appends `value` to `out`.
+template <typename T>
+void AppendValue(LineBuffer& out, const T& value) {
+  Formatter<T>::Append(out, value);
+}
+}  // namespace internal
+
+// An argument that is only computed if the record is formatted, made by
+// lazy():
+//
+//   logger.Print("state: {}", lazy([&] { return DumpState(); }));
+//
+// calls DumpState() only if Level::kInfo is enabled, even when the call is
+// not wrapped in LOGGER_LOG. The function is called each time the value is
+// formatted, which for a kv() field may be once per sink, and its result
+// formatted like any other argument.
+template <typename Fn>
+class LazyValue {
+ public:
+  explicit LazyValue(Fn fn) : fn_(std::move(fn)) {}
+
+  auto operator()() const -> decltype(std::declval<const Fn&>()()) {
+    return fn_();
+  }
+
+ private:
+  Fn fn_;
+};
+
+template <typename Fn>
+LazyValue<typename std::decay<Fn>::type> lazy(Fn&& fn) {
+  return LazyValue<typename std::decay<Fn>::type>(std::forward<Fn>(fn));
+}
+
+namespace internal {
+template <typename Fn>
+struct Formatter<LazyValue<Fn>> {
+  static void Append(LineBuffer& out, const LazyValue<Fn>& value) {
+    AppendValue(out, value());
+  }
+};
+
+// Where the "{}" placeholders of one format are, found the first time a
+// LOGGER_LOG call site formats it (see FormatSiteScope) and reused by every
+// later call from that site on the same thread. A format with more than
+// kMaxCachedPlaceholders of them is not cached and scanned each time.
+enum : size_t { kMaxCachedPlaceholders = 16 };
+
+struct FormatPlan {
+  const char* format;  // Null until the plan is made.
+  size_t size;
+  size_t count;  // Above kMaxCachedPlaceholders if not cacheable.
+  size_t offsets[kMaxCachedPlaceholders];
+};
+
+// The plan, if any, StrFormat may use for the format at `format`, `size`.
+struct FormatSite {
+  FormatPlan* plan;
+  const char* format;
+  size_t size;
+};
+
+inline FormatSite& CurrentFormatSite() {
+  static thread_local FormatSite site;
+  return site;
+}
+
+// Offers `plan` to the StrFormat calls made until the scope ends, for the
+// format `format`: a const char array, which at a given call site always
+// holds the same text. Any other format, or a StrFormat of a different
+// one made meanwhile, is scanned as usual.
+class FormatSiteScope {
+ public:
+  template <typename F>
+  FormatSiteScope(FormatPlan& plan, F&& format) : saved_(CurrentFormatSite()) {
+    typedef typename std::remove_reference<F>::type Format;
+    Offer(plan, format, std::extent<Format>::value,
+          std::integral_constant<
+              bool, std::is_array<Format>::value &&
+                        std::is_same<typename std::remove_extent<Format>::type,
+                                     const char>::value>());
+  }
+
+  ~FormatSiteScope() { CurrentFormatSite() = saved_; }
+
+  FormatSiteScope(const FormatSiteScope&) = delete;
+  FormatSiteScope& operator=(const FormatSiteScope&) = delete;
+
+ private:
+  static void Offer(FormatPlan& plan, const char* format, size_t extent,
+                    std::true_type) {
+    FormatSite& site = CurrentFormatSite();
+    site.plan = &plan;
+    site.format = format;
+    site.size = extent - 1;
+  }
+
+  template <typename F>
+  static void Offer(FormatPlan& /*plan*/, const F& /*format*/,
+                    size_t /*extent*/, std::false_type) {}
+
+  FormatSite saved_;
+};
+
+// Returns the plan offered for `format`, made now if it is the first use,
+// or null if there is none or the format has too many placeholders.
+inline const FormatPlan* PlanFor(StringView format) {
+  const FormatSite& site = CurrentFormatSite();
+  FormatPlan* plan = site.plan;
+  if (plan == nullptr || site.format != format.data() ||
+      site.size != format.size()) {
+    return nullptr;
+  }
+  if (plan->format != format.data() || plan->size != format.size()) {
+    size_t count = 0;
+    size_t pos = format.find("{}");
+    while (pos != StringView::npos && count <= kMaxCachedPlaceholders) {
+      if (count < kMaxCachedPlaceholders) {
+        plan->offsets[count] = pos;
+      }
+      ++count;
+      pos = format.find("{}", pos + 2);
+    }
+    plan->count = count;
+    plan->format = format.data();
+    plan->size = format.size();
+  }
+  return plan->count <= kMaxCachedPlaceholders ? plan : nullptr;
+}
+
+inline void StrFormatPlanned(LineBuffer& out, StringView format,
+                             const FormatPlan& /*plan*/, size_t /*index*/,
+                             size_t from) {
+  out.append(format.data() + from, format.size() - from);
+}
+
+template <typename T, typename... Args>
+void StrFormatPlanned(LineBuffer& out, StringView format,
+                      const FormatPlan& plan, size_t index, size_t from,
+                      const T& value, const Args&... args) {
+  if (index == plan.count) {
+    out.append(format.data() + from, format.size() - from);
+    return;
+  }
+  size_t pos = plan.offsets[index];
+  out.append(format.data() + from, pos - from);
+  AppendValue(out, value);
+  StrFormatPlanned(out, format, plan, index + 1, pos + 2, args...);
+}
+
+inline void StrFormatScanned(LineBuffer& out, StringView format) {
+  out.append(format.data(), format.size());
+}
+
+template <typename T, typename... Args>
+void StrFormatScanned(LineBuffer& out, StringView format, const T& value,
+                      const Args&... args) {
+  size_t pos = format.find("{}");
+  if (pos == StringView::npos) {
+    out.append(format.data(), format.size());
+    return;
+  }
+  out.append(format.data(), pos);
+  AppendValue(out, value);
+  StrFormatScanned(out, format.substr(pos + 2), args...);
+}
+
+// StrFormat(out, "{} + {} = {}", 1, 2, 3) appends "1 + 2 = 3" to `out`.
+//
+// Every literal run is appended straight from the format and every "{}" is
+// replaced by the next argument, without building substrings. A format
+// logged through LOGGER_LOG uses the placeholder offsets cached for its
+// call site; any other is scanned once, front to back. Placeholders without
+// an argument are kept as they are and arguments without a placeholder are
+// ignored.
+inline void StrFormat(LineBuffer& out, StringView format) {
+  out.append(format.data(), format.size());
+}
+
+template <typename T, typename... Args>
+void StrFormat(LineBuffer& out, StringView format, const T& value,
+               const Args&... args) {
+  const FormatPlan* plan = PlanFor(format);
+  if (plan != nullptr) {
+    StrFormatPlanned(out, format, *plan, 0, 0, value, args...);
+  } else {
+    StrFormatScanned(out, format, value, args...);
+  }
+}
+
+}  // namespace internal
+
+#endif /* FORMAT_H_ */
@@ -0,0 +1,209 @@
+#ifndef JSON_LOGGER_H_
+#define JSON_LOGGER_H_
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOGGER_HAS_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "logger.h"
+
+namespace internal {
+inline bool NeedsJsonEscape(char c) {
+  return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+}
+
+inline void AppendJsonEscape(LineBuffer& out, char c) {
+  static const char kHex[] = "0123456789abcdef";
+  out += '\\';
+  switch (c) {
+    case '"':
+      out += '"';
+      break;
+    case '\\':
+      out += '\\';
+      break;
+    case '\n':
+      out += 'n';
+      break;
+    case '\r':
+      out += 'r';
+      break;
+    case '\t':
+      out += 't';
+      break;
+    default:
+      out += "u00";
+      out += kHex[(c >> 4) & 0xf];
+      out += kHex[c & 0xf];
+  }
+}
+
+#ifdef LOGGER_HAS_SSE2
+inline int CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Appends `str` as a quoted JSON string. Runs that need no escaping, which
+// is nearly all of a log message, are found 16 bytes at a time with SSE2
+// and copied as they are. Bytes above 0x7f are copied too, so UTF-8 stays
+// UTF-8.
+inline void AppendJsonString(LineBuffer& out, StringView str) {
+  out += '"';
+  const char* p = str.data();
+  const char* end = p + str.size();
+  const char* run = p;
+#ifdef LOGGER_HAS_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i last_control = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    // The bytes x <= 0x1f, unsigned, are those with min(x, 0x1f) == x.
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(chunk, last_control), chunk));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+    if (mask == 0) {
+      p += 16;
+      continue;
+    }
+    p += CountTrailingZeros(mask);
+    out.append(run, p - run);
+    AppendJsonEscape(out, *p);
+    run = ++p;
+  }
+#endif
+  for (; p < end; ++p) {
+    if (NeedsJsonEscape(*p)) {
+      out.append(run, p - run);
+      AppendJsonEscape(out, *p);
+      run = p + 1;
+    }
+  }
+  out.append(run, end - run);
+  out += '"';
+}
+
+inline void AppendJsonValue(LineBuffer& out, const Field& field) {
+  switch (field.type) {
+    case Field::Type::kInt:
+    case Field::Type::kUint:
+      field.AppendValue(out);
+      break;
+    case Field::Type::kDouble:
+      // JSON has no infinities or NaNs.
+      if (std::isfinite(field.double_value)) {
+        field.AppendValue(out);
+      } else {
+        out += "null";
+      }
+      break;
+    case Field::Type::kBool:
+      out += field.bool_value ? "true" : "false";
+      break;
+    case Field::Type::kString:
+      AppendJsonString(out, field.string_value);
+      break;
+    case Field::Type::kChar:
+    case Field::Type::kOther: {
+      ScopedLineBuffer text;
+      field.AppendValue(text.get());
+      AppendJsonString(out, text->view());
+      break;
+    }
+  }
+}
+}  // namespace internal
+
+struct JsonFileLoggerOptions : LogFileOptions {
+  TimestampPrecision timestamp_precision = TimestampPrecision::kMilliseconds;
+};
+
+// Writes one JSON object per line to "path/log-<name>.jsonl":
+//
+//   {"time":"2024-05-01 12:00:00.000","level":"INFO","msg":"...","user":42}
+//
+// The fields of a structured Print follow "msg" in order, straight from the
+// call's arguments; keys are not checked for duplicates. Messages from the
+// positional Print("{}", ...) API have no fields.
+class JsonFileLogger : public Logger {
+ public:
+  JsonFileLogger(
+      const std::string& path, const std::string& name,
+      const JsonFileLoggerOptions& options = JsonFileLoggerOptions())
+      : file_(path + "/log-" + name + ".jsonl", options, &stats()),
+        precision_(options.timestamp_precision) {
+    Print("{} started", name);
+  }
+
+  ~JsonFileLogger() override {
+    PrintMessage(Level::kInfo, "Closing the log.");
+  }
+
+  using Logger::Print;
+  void Print(const std::string& str) override {
+    PrintMessage(Level::kInfo, str);
+  }
+
+  void PrintMessage(Level level, StringView message) override {
+    PrintStructured(level, message, nullptr, 0);
+  }
+
+  void PrintStructured(Level level, StringView message, const Field* fields,
+                       size_t count) override {
+    int64_t start = internal::CycleClock::Now();
+    internal::ScopedLineBuffer line;
+    line.get() += "{\"time\":\"";
+    line->Commit(internal::FormatTimestamp(
+        std::chrono::system_clock::now(), line->Extend(kMaxTimestampSize),
+        precision_));
+    line.get() += "\",\"level\":\"";
+    line.get() += LevelName(level);
+    line.get() += "\",\"msg\":";
+    internal::AppendJsonString(line.get(), message);
+    for (size_t i = 0; i < count; ++i) {
+      line.get() += ',';
+      internal::AppendJsonString(line.get(), fields[i].key);
+      line.get() += ':';
+      internal::AppendJsonValue(line.get(), fields[i]);
+    }
+    line.get() += "}\n";
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      file_.Write(line->view(), 1, level);
+    }
+    stats().AddRecords(1);
+    stats().AddProducerLatency(internal::CycleClock::Now() - start);
+  }
+
+  void Flush() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_.Flush();
+  }
+
+ private:
+  std::mutex mutex_;
+  LogFile file_;
+  TimestampPrecision precision_;
+};
+
+#endif /* JSON_LOGGER_H_ */
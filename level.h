@@ -0,0 +1,74 @@
+#ifndef LEVEL_H_
+#define LEVEL_H_
+
+#include <cctype>
+
+#include "string_view.h"
+
+// Severity of a log record, from least to most severe.
+enum class Level {
+  kTrace = 0,
+  kDebug = 1,
+  kInfo = 2,
+  kWarning = 3,
+  kError = 4,
+  kFatal = 5,
+  // Only used as a threshold: disables every level.
+  kOff = 6,
+};
+
+inline const char* LevelName(Level level) {
+  switch (level) {
+    case Level::kTrace:
+      return "TRACE";
+    case Level::kDebug:
+      return "DEBUG";
+    case Level::kInfo:
+      return "INFO";
+    case Level::kWarning:
+      return "WARNING";
+    case Level::kError:
+      return "ERROR";
+    case Level::kFatal:
+      return "FATAL";
+    case Level::kOff:
+      return "OFF";
+  }
+  return "UNKNOWN";
+}
+
+// Reads a level as LevelName() spells it, in any case, e.g. "warning".
+// Returns false if `name` is none of them.
+inline bool ParseLevel(StringView name, Level* level) {
+  for (int i = 0; i <= static_cast<int>(Level::kOff); ++i) {
+    const char* candidate = LevelName(static_cast<Level>(i));
+    size_t j = 0;
+    while (j < name.size() && candidate[j] != '\0' &&
+           std::toupper(static_cast<unsigned char>(name[j])) == candidate[j]) {
+      ++j;
+    }
+    if (j == name.size() && candidate[j] == '\0') {
+      *level = static_cast<Level>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The same levels for the preprocessor.
+#define LOGGER_LEVEL_TRACE 0
+#define LOGGER_LEVEL_DEBUG 1
+#define LOGGER_LEVEL_INFO 2
+#define LOGGER_LEVEL_WARNING 3
+#define LOGGER_LEVEL_ERROR 4
+#define LOGGER_LEVEL_FATAL 5
+#define LOGGER_LEVEL_OFF 6
+
+// LOGGER_TRACE(...) ... LOGGER_FATAL(...) below this level compile to
+// nothing, like SPIEL_DCHECK_* in a Release build. Define it before
+// including logger.h, e.g. -DLOGGER_MIN_LEVEL=LOGGER_LEVEL_INFO.
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL LOGGER_LEVEL_TRACE
+#endif
+
+#endif /* LEVEL_H_ */
@@ -0,0 +1,170 @@
+#ifndef LINE_BUFFER_H_
+#define LINE_BUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "string_view.h"
+#include "utils.h"
+
+namespace internal {
+// A growable character buffer with inline storage for short lines. Lines
+// that do not fit move to the heap; ShrinkToLimit() gives oversized heap
+// storage back so one huge message does not pin memory forever.
+class LineBuffer {
+ public:
+  // Bytes stored inside the object itself.
+  static constexpr size_t kInlineCapacity = 256;
+  // Heap storage above this is released by ShrinkToLimit().
+  static constexpr size_t kMaxRetainedCapacity = 64 * 1024;
+
+  LineBuffer() : data_(inline_), size_(0), capacity_(kInlineCapacity) {}
+  ~LineBuffer() { Release(); }
+
+  LineBuffer(const LineBuffer&) = delete;
+  LineBuffer& operator=(const LineBuffer&) = delete;
+
+  const char* data() const { return data_; }
+  char* data() { return data_; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+  StringView view() const { return StringView(data_, size_); }
+  std::string ToString() const { return std::string(data_, size_); }
+
+  void clear() { size_ = 0; }
+
+  void reserve(size_t capacity) {
+    if (capacity > capacity_) {
+      Grow(capacity);
+    }
+  }
+
+  // Makes room for `count` more bytes and returns where they go. Call
+  // Commit() with the number actually written.
+  char* Extend(size_t count) {
+    reserve(size_ + count);
+    return data_ + size_;
+  }
+  void Commit(size_t count) { size_ += count; }
+
+  void append(const char* data, size_t count) {
+    std::memcpy(Extend(count), data, count);
+    size_ += count;
+  }
+  void append(StringView str) { append(str.data(), str.size()); }
+
+  LineBuffer& operator+=(StringView str) {
+    append(str);
+    return *this;
+  }
+  LineBuffer& operator+=(char c) {
+    if (size_ == capacity_) {
+      Grow(size_ + 1);
+    }
+    data_[size_++] = c;
+    return *this;
+  }
+
+  void ShrinkToLimit() {
+    if (capacity_ > kMaxRetainedCapacity) {
+      Release();
+      data_ = inline_;
+      size_ = 0;
+      capacity_ = kInlineCapacity;
+    }
+  }
+
+  // Number of heap allocations made by all line buffers so far. Logging in
+  // a steady state should leave it unchanged.
+  static uint64_t HeapAllocations() {
+    return HeapAllocationCounter().load(std::memory_order_relaxed);
+  }
+
+ private:
+  static std::atomic<uint64_t>& HeapAllocationCounter() {
+    static std::atomic<uint64_t> counter(0);
+    return counter;
+  }
+
+  void Grow(size_t min_capacity) {
+    size_t capacity = capacity_ * 2;
+    if (capacity < min_capacity) {
+      capacity = min_capacity;
+    }
+    char* data = static_cast<char*>(std::malloc(capacity));
+    SPIEL_CHECK_TRUE(data != nullptr);
+    HeapAllocationCounter().fetch_add(1, std::memory_order_relaxed);
+    std::memcpy(data, data_, size_);
+    Release();
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void Release() {
+    if (data_ != inline_) {
+      std::free(data_);
+    }
+  }
+
+  char* data_;
+  size_t size_;
+  size_t capacity_;
+  char inline_[kInlineCapacity];
+};
+
+// A line buffer borrowed from the calling thread for the lifetime of this
+// object, so steady-state logging reuses the same memory. Up to kDepth
+// buffers can be borrowed at once (a logger formats the message, then the
+// line around it, and may itself log from inside Print); deeper nesting
+// falls back to a buffer of its own.
+class ScopedLineBuffer {
+ public:
+  static constexpr int kDepth = 4;
+
+  ScopedLineBuffer() : buffer_(nullptr) {
+    Pool& pool = ThreadPool();
+    if (pool.depth < kDepth) {
+      buffer_ = &pool.buffers[pool.depth++];
+    } else {
+      own_.reset(new LineBuffer());
+      buffer_ = own_.get();
+    }
+    buffer_->clear();
+  }
+
+  ~ScopedLineBuffer() {
+    if (!own_) {
+      buffer_->ShrinkToLimit();
+      --ThreadPool().depth;
+    }
+  }
+
+  ScopedLineBuffer(const ScopedLineBuffer&) = delete;
+  ScopedLineBuffer& operator=(const ScopedLineBuffer&) = delete;
+
+  LineBuffer& get() { return *buffer_; }
+  LineBuffer* operator->() { return buffer_; }
+
+ private:
+  struct Pool {
+    LineBuffer buffers[kDepth];
+    int depth = 0;
+  };
+
+  static Pool& ThreadPool() {
+    static thread_local Pool pool;
+    return pool;
+  }
+
+  LineBuffer* buffer_;
+  std::unique_ptr<LineBuffer> own_;
+};
+}  // namespace internal
+
+#endif /* LINE_BUFFER_H_ */